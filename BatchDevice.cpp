@@ -0,0 +1,75 @@
+#include "BatchDevice.h"
+
+
+BatchDevice::BatchDevice(std::unique_ptr<Device> device)
+        : m_Device(std::move(device)),
+        m_HeldWrites(0) {}
+
+bool BatchDevice::isData(unsigned int index) {
+    return index >= Device::DATA_START && index < Device::REFCOUNTS_START;
+}
+
+void BatchDevice::writeBlock(unsigned int index, const Block& block) {
+    writeBlocks(index, {block});
+}
+
+void BatchDevice::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
+    for (unsigned int i = 0; i < blocks.size();) {
+        if (!isData(shift + i)) {
+            m_Pending.insert_or_assign(shift + i, blocks[i]);
+            m_HeldWrites++;
+            i++;
+            continue;
+        }
+        // Runs of data blocks go through as they came
+        unsigned int run = 1;
+        while (i + run < blocks.size() && isData(shift + i + run)) run++;
+        if (run == blocks.size()) {
+            m_Device->writeBlocks(shift, blocks);
+        } else {
+            m_Device->writeBlocks(shift + i,
+                    std::vector<Block>(blocks.begin() + i, blocks.begin() + i + run));
+        }
+        i += run;
+    }
+}
+
+Block BatchDevice::readBlock(unsigned int index) {
+    if (const auto it = m_Pending.find(index); it != m_Pending.end()) return it->second;
+    return m_Device->readBlock(index);
+}
+
+std::vector<Block> BatchDevice::readBlocks(unsigned int shift, unsigned int amount) {
+    const auto from = m_Pending.lower_bound(shift);
+    const auto to = m_Pending.lower_bound(shift + amount);
+    if (std::distance(from, to) == static_cast<long>(amount)) {
+        std::vector<Block> blocks;
+        for (auto it = from; it != to; it++) blocks.push_back(it->second);
+        return blocks;
+    }
+
+    std::vector<Block> blocks = m_Device->readBlocks(shift, amount);
+    for (auto it = from; it != to; it++) blocks[it->first - shift] = it->second;
+    return blocks;
+}
+
+void BatchDevice::sync() {
+    m_Device->sync();
+}
+
+void BatchDevice::apply() {
+    for (auto it = m_Pending.begin(); it != m_Pending.end();) {
+        const unsigned int shift = it->first;
+        std::vector<Block> run;
+        for (; it != m_Pending.end() && it->first == shift + run.size(); it++) run.push_back(std::move(it->second));
+        m_Device->writeBlocks(shift, run);
+    }
+    m_Pending.clear();
+    m_HeldWrites = 0;
+}
+
+std::unique_ptr<Device> BatchDevice::release() {
+    m_Pending.clear();
+    m_HeldWrites = 0;
+    return std::move(m_Device);
+}
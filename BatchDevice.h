@@ -0,0 +1,55 @@
+#ifndef BATCHDEVICE_H
+#define BATCHDEVICE_H
+
+#include "Device.h"
+#include <memory>
+#include <map>
+
+
+// Holds back the writes of metadata (every block outside the data blocks)
+// in memory, a single copy per block however often it is written, until
+// apply() writes them all in block order. Data blocks go through at once,
+// so they are on the device before any metadata pointing to them.
+struct BatchDevice : public Device {
+    private:
+        std::unique_ptr<Device> m_Device;
+        std::map<unsigned int, Block> m_Pending; // ordered to merge runs
+        unsigned int m_HeldWrites; // block writes since the last apply()
+
+        static bool isData(unsigned int index);
+
+    public:
+        void writeBlock(unsigned int index, const Block& block) override;
+        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) override;
+        Block readBlock(unsigned int index) override;
+        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) override;
+
+        // Only what was written through already, the held back blocks stay
+        void sync() override;
+
+        inline bool is_open() const override {
+            return m_Device->is_open();
+        }
+
+        inline unsigned int getSize() const override {
+            return m_Device->getSize();
+        }
+
+        inline unsigned int pendingBlocks() const {
+            return m_Pending.size();
+        }
+
+        inline unsigned int heldWrites() const {
+            return m_HeldWrites;
+        }
+
+        // Writes the held back blocks, runs of consecutive ones at once
+        void apply();
+        // The underlying device, held back blocks are dropped
+        std::unique_ptr<Device> release();
+
+        explicit BatchDevice(std::unique_ptr<Device> device);
+};
+
+
+#endif
@@ -1,5 +1,6 @@
 #include "Block.h"
 #include "Device.h"
+#include <cstring>
 
 
 unsigned int ceil(unsigned int a, unsigned int b) noexcept {
@@ -12,16 +13,11 @@ const uint16_t Block::INVALID = UINT16_MAX;
 
 Block::Block() : bytes(Device::BLOCK_SIZE, 0) {}
 
-Block::Block(const std::vector<uint8_t>& bytes) {
+Block::Block(const std::vector<uint8_t>& bytes) : bytes(bytes) {
     assert(bytes.size() == Device::BLOCK_SIZE);
-    for (unsigned int i = 0; i < Device::BLOCK_SIZE; i++)
-        this->bytes.push_back(bytes[i]);
 }
 
-Block::Block(uint8_t* bytes) {
-    for (unsigned int i = 0; i < Device::BLOCK_SIZE; i++)
-        this->bytes.push_back(bytes[i]);
-}
+Block::Block(const uint8_t* bytes) : bytes(bytes, bytes + Device::BLOCK_SIZE) {}
 
 Block::Block(const std::string& str) : Block() {
     unsigned int index = 0;
@@ -47,6 +43,10 @@ const uint8_t* Block::asArray() const {
     return bytes.data();
 }
 
+uint8_t* Block::asArray() {
+    return bytes.data();
+}
+
 std::string Block::asString() const {
     std::string str;
     for (unsigned int i = 0; i < bytes.size(); i++) {
@@ -56,3 +56,58 @@ std::string Block::asString() const {
 
     return str;
 }
+
+
+// N is the block size, 0 to take it from Device::BLOCK_SIZE
+template <unsigned int N>
+static unsigned int blockSize() {
+    if constexpr (N == 0) {
+        return Device::BLOCK_SIZE;
+    } else {
+        assert(Device::BLOCK_SIZE == N);
+        return N;
+    }
+}
+
+template <unsigned int N>
+static void gather(std::span<const Block> blocks, uint8_t* out) {
+    const unsigned int size = blockSize<N>();
+    for (const Block& block : blocks) {
+        std::memcpy(out, block.asArray(), size);
+        out += size;
+    }
+}
+
+template <unsigned int N>
+static std::vector<Block> scatter(const uint8_t* bytes, unsigned int size) {
+    const unsigned int n = blockSize<N>();
+    std::vector<Block> blocks;
+    blocks.reserve(ceil(size, n));
+    for (unsigned int at = 0; at + n <= size; at += n) blocks.emplace_back(bytes + at);
+    if (size % n != 0) {
+        Block last;
+        std::memcpy(last.asArray(), bytes + size - size % n, size % n);
+        blocks.push_back(std::move(last));
+    }
+
+    return blocks;
+}
+
+template <unsigned int N>
+static bool equal(const uint8_t* a, const uint8_t* b) {
+    return std::memcmp(a, b, blockSize<N>()) == 0;
+}
+
+template <unsigned int N>
+static constexpr BlockKernels KERNELS{N, gather<N>, scatter<N>, equal<N>};
+
+const BlockKernels BlockKernels::GENERIC = KERNELS<0>;
+
+const BlockKernels& BlockKernels::select(unsigned int blockSize) {
+    switch (blockSize) {
+        case 8: return KERNELS<8>;
+        case 512: return KERNELS<512>;
+        case 4096: return KERNELS<4096>;
+        default: return GENERIC;
+    }
+}
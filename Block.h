@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cassert>
 #include <string>
+#include <span>
 
 unsigned int ceil(unsigned int a, unsigned int b) noexcept;
 
@@ -18,13 +19,31 @@ struct Block {
         uint8_t& operator[](unsigned int index);
         const uint8_t& operator[](unsigned int index) const;
         const uint8_t* asArray() const;
+        uint8_t* asArray();
         std::string asString() const;
 
         Block();
         Block(const std::vector<uint8_t>& bytes);
-        Block(uint8_t* bytes);
+        Block(const uint8_t* bytes);
         Block(const std::string& str);
 };
 
+// Loops over whole blocks, with the block size a compile-time constant so
+// that they are unrolled and vectorized. There is a set for each of the
+// common block sizes and a generic one for the rest. Device::setBlockSize
+// picks the one in use (Device::KERNELS) when a device is mounted
+struct BlockKernels {
+    public:
+        unsigned int blockSize; // 0 for the generic set
+        // The contents of the blocks one after the other
+        void (*gather)(std::span<const Block> blocks, uint8_t* out);
+        // size bytes as blocks, the last one padded with zeros
+        std::vector<Block> (*scatter)(const uint8_t* bytes, unsigned int size);
+        bool (*equal)(const uint8_t* a, const uint8_t* b);
+
+        static const BlockKernels GENERIC; // for any block size
+        static const BlockKernels& select(unsigned int blockSize);
+};
+
 
 #endif
@@ -0,0 +1,131 @@
+#include "ChecksumDevice.h"
+#include "Crc32c.h"
+#include <string>
+#include <algorithm>
+
+
+static const unsigned int CHECKSUM_SIZE = sizeof(uint32_t);
+
+
+ChecksumError::ChecksumError(unsigned int blockIndex)
+        : std::runtime_error("Checksum mismatch in block " + std::to_string(blockIndex)),
+        blockIndex(blockIndex) {}
+
+
+ChecksumDevice::ChecksumDevice(std::unique_ptr<Device> device, unsigned int checksumStart)
+        : m_Device(std::move(device)),
+        m_ChecksumStart(checksumStart),
+        m_Checksums(readTable(*m_Device, checksumStart)) {}
+
+std::vector<uint32_t> ChecksumDevice::readTable(Device& device, unsigned int checksumStart) {
+    std::vector<uint32_t> checksums(checksumStart, 0);
+    const unsigned int regionBlocks = regionSizeInBlocks(checksumStart, BLOCK_SIZE);
+    const std::vector<Block> region = device.readBlocks(checksumStart, regionBlocks);
+    for (unsigned int i = 0; i < checksumStart; i++) {
+        const Block& block = region[i * CHECKSUM_SIZE / BLOCK_SIZE];
+        const unsigned int shift = i * CHECKSUM_SIZE % BLOCK_SIZE;
+        checksums[i] = static_cast<uint32_t>(block[shift])
+            | static_cast<uint32_t>(block[shift + 1]) << 8
+            | static_cast<uint32_t>(block[shift + 2]) << 16
+            | static_cast<uint32_t>(block[shift + 3]) << 24;
+    }
+
+    return checksums;
+}
+
+unsigned int ChecksumDevice::regionSizeInBlocks(unsigned int blocks, unsigned int blockSize) {
+    return ceil(blocks * CHECKSUM_SIZE, blockSize);
+}
+
+uint32_t ChecksumDevice::checksum(const Block& block) {
+    return crc32c(block.asArray(), BLOCK_SIZE);
+}
+
+// Stores the new checksums and writes the table blocks they are in
+void ChecksumDevice::update(unsigned int shift, const std::vector<Block>& blocks) {
+    if (blocks.empty()) return;
+    assert(shift + blocks.size() <= m_ChecksumStart);
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        m_Checksums[shift + i] = checksum(blocks[i]);
+    }
+
+    const unsigned int entriesPerBlock = BLOCK_SIZE / CHECKSUM_SIZE;
+    const unsigned int firstTableBlock = shift / entriesPerBlock;
+    const unsigned int lastTableBlock = (shift + blocks.size() - 1) / entriesPerBlock;
+    std::vector<Block> table;
+    for (unsigned int t = firstTableBlock; t <= lastTableBlock; t++) {
+        Block block;
+        for (unsigned int e = 0; e < entriesPerBlock; e++) {
+            const unsigned int index = t * entriesPerBlock + e;
+            if (index >= m_ChecksumStart) break;
+            const uint32_t crc = m_Checksums[index];
+            for (unsigned int byte = 0; byte < CHECKSUM_SIZE; byte++) {
+                block[e * CHECKSUM_SIZE + byte] = (crc >> (8 * byte)) & 0xFF;
+            }
+        }
+        table.push_back(block);
+    }
+    m_Device->writeBlocks(m_ChecksumStart + firstTableBlock, table);
+}
+
+void ChecksumDevice::verify(unsigned int index, const Block& block) const {
+    if (index >= m_ChecksumStart) return; // the table itself
+    if (checksum(block) != m_Checksums[index]) throw ChecksumError(index);
+}
+
+void ChecksumDevice::writeBlock(unsigned int index, const Block& block) {
+    m_Device->writeBlock(index, block);
+    update(index, {block});
+}
+
+void ChecksumDevice::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
+    m_Device->writeBlocks(shift, blocks);
+    update(shift, blocks);
+}
+
+Block ChecksumDevice::readBlock(unsigned int index) {
+    Block block = m_Device->readBlock(index);
+    verify(index, block);
+    return block;
+}
+
+std::vector<Block> ChecksumDevice::readBlocks(unsigned int shift, unsigned int amount) {
+    std::vector<Block> blocks = m_Device->readBlocks(shift, amount);
+    for (unsigned int i = 0; i < blocks.size(); i++) verify(shift + i, blocks[i]);
+    return blocks;
+}
+
+void ChecksumDevice::sync() {
+    m_Device->sync();
+}
+
+std::vector<unsigned int> ChecksumDevice::findCorrupted(Device& device, unsigned int checksumStart) {
+    const std::vector<uint32_t> checksums = readTable(device, checksumStart);
+    std::vector<unsigned int> corrupted;
+    const unsigned int batch = 256;
+    for (unsigned int shift = 0; shift < checksumStart; shift += batch) {
+        const unsigned int amount = std::min(batch, checksumStart - shift);
+        const std::vector<Block> blocks = device.readBlocks(shift, amount);
+        for (unsigned int i = 0; i < amount; i++) {
+            if (checksum(blocks[i]) != checksums[shift + i]) corrupted.push_back(shift + i);
+        }
+    }
+
+    return corrupted;
+}
+
+void ChecksumDevice::initialize(Device& device, unsigned int checksumStart) {
+    std::vector<uint8_t> table(regionSizeInBlocks(checksumStart, BLOCK_SIZE) * BLOCK_SIZE, 0);
+    for (unsigned int i = 0; i < checksumStart; i++) {
+        const uint32_t crc = checksum(device.readBlock(i));
+        for (unsigned int byte = 0; byte < CHECKSUM_SIZE; byte++) {
+            table[i * CHECKSUM_SIZE + byte] = (crc >> (8 * byte)) & 0xFF;
+        }
+    }
+
+    std::vector<Block> blocks;
+    for (unsigned int i = 0; i < table.size() / BLOCK_SIZE; i++) {
+        blocks.emplace_back(table.data() + i * BLOCK_SIZE);
+    }
+    device.writeBlocks(checksumStart, blocks);
+}
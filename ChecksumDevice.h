@@ -0,0 +1,59 @@
+#ifndef CHECKSUMDEVICE_H
+#define CHECKSUMDEVICE_H
+
+#include "Device.h"
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+
+struct ChecksumError : public std::runtime_error {
+    const unsigned int blockIndex;
+
+    ChecksumError(unsigned int blockIndex);
+};
+
+
+// Keeps a CRC32C of every block of the underlying device in a region at
+// its very end. The whole table is held in memory: reads are verified
+// against it without extra I/O, writes update the affected table blocks.
+struct ChecksumDevice : public Device {
+    private:
+        std::unique_ptr<Device> m_Device;
+        unsigned int m_ChecksumStart; // first block of the checksum region
+        std::vector<uint32_t> m_Checksums; // per block in [0, m_ChecksumStart)
+
+        static uint32_t checksum(const Block& block);
+        static std::vector<uint32_t> readTable(Device& device, unsigned int checksumStart);
+        void update(unsigned int shift, const std::vector<Block>& blocks);
+        void verify(unsigned int index, const Block& block) const;
+
+    public:
+        void writeBlock(unsigned int index, const Block& block) override;
+        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) override;
+        // Throw ChecksumError if the data does not match its checksum
+        Block readBlock(unsigned int index) override;
+        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) override;
+
+        void sync() override;
+
+        inline bool is_open() const override {
+            return m_Device->is_open();
+        }
+
+        inline unsigned int getSize() const override {
+            return m_Device->getSize();
+        }
+
+        // checksumStart: amount of blocks covered, the region follows them
+        ChecksumDevice(std::unique_ptr<Device> device, unsigned int checksumStart);
+
+        static unsigned int regionSizeInBlocks(unsigned int blocks, unsigned int blockSize);
+        // (Re)computes checksums of all the blocks before checksumStart
+        static void initialize(Device& device, unsigned int checksumStart);
+        // Indices of the blocks that do not match their stored checksums
+        static std::vector<unsigned int> findCorrupted(Device& device, unsigned int checksumStart);
+};
+
+
+#endif
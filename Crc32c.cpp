@@ -0,0 +1,67 @@
+#include "Crc32c.h"
+#include <array>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+
+static const uint32_t CRC32C_POLY = 0x82F63B78; // reversed 0x1EDC6F41
+
+using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+static Tables makeTables() noexcept {
+    Tables tables{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (unsigned int t = 1; t < 8; t++) {
+            tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+        }
+    }
+    return tables;
+}
+
+static uint32_t crc32cPortable(const uint8_t* data, size_t size, uint32_t crc) noexcept {
+    static const Tables tables = makeTables();
+    while (size >= 8) {
+        const uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16
+                | static_cast<uint32_t>(data[3]) << 24);
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF]
+            ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+            ^ tables[3][data[4]] ^ tables[2][data[5]]
+            ^ tables[1][data[6]] ^ tables[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const uint8_t* data, size_t size, uint32_t crc) noexcept {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc) noexcept {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cHardware(data, size, ~crc);
+#endif
+    return ~crc32cPortable(data, size, ~crc);
+}
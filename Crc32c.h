@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU
+// supports it and a table-driven (slicing-by-8) version otherwise.
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0) noexcept;
+
+
+#endif
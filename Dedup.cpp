@@ -0,0 +1,71 @@
+#include "Dedup.h"
+#include "Crc32c.h"
+
+
+uint32_t DedupIndex::hash(const Block& block) {
+    return crc32c(block.asArray(), Device::BLOCK_SIZE);
+}
+
+std::optional<uint16_t> DedupIndex::find(Device& device, const Block& block, uint32_t hash) const {
+    const auto range = m_Index.equal_range(hash);
+    for (auto it = range.first; it != range.second; it++) {
+        const Block candidate = device.readBlock(Device::DATA_START + it->second);
+        if (Device::KERNELS->equal(candidate.asArray(), block.asArray())) {
+            return {it->second};
+        }
+    }
+
+    return std::nullopt;
+}
+
+void DedupIndex::insert(uint16_t blockIndex, uint32_t hash) {
+    erase(blockIndex);
+    m_Hashes[blockIndex] = hash;
+    m_Index.emplace(hash, blockIndex);
+    m_Dirty.insert(blockIndex * sizeof(uint32_t) / Device::BLOCK_SIZE);
+}
+
+void DedupIndex::erase(uint16_t blockIndex) {
+    const auto range = m_Index.equal_range(m_Hashes[blockIndex]);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second == blockIndex) {
+            m_Index.erase(it);
+            return;
+        }
+    }
+}
+
+void DedupIndex::write(Device& device) {
+    const unsigned int perBlock = Device::BLOCK_SIZE / sizeof(uint32_t);
+    for (unsigned int regionBlock : m_Dirty) {
+        Block block;
+        for (unsigned int i = 0; i < perBlock; i++) {
+            const unsigned int index = regionBlock * perBlock + i;
+            if (index >= m_Hashes.size()) break;
+            for (unsigned int b = 0; b < sizeof(uint32_t); b++) {
+                block[i * sizeof(uint32_t) + b] = (m_Hashes[index] >> (8 * b)) & 0xFF;
+            }
+        }
+        device.writeBlock(Device::HASHES_START + regionBlock, block);
+    }
+    m_Dirty.clear();
+}
+
+DedupIndex DedupIndex::read(Device& device, const DeviceBlockMap& map) {
+    DedupIndex result;
+    const unsigned int regionBlocks = ceil(map.size * sizeof(uint32_t), Device::BLOCK_SIZE);
+    std::vector<uint8_t> bytes;
+    for (const Block& block : device.readBlocks(Device::HASHES_START, regionBlocks)) {
+        bytes.insert(bytes.end(), block.asArray(), block.asArray() + Device::BLOCK_SIZE);
+    }
+
+    result.m_Hashes.resize(map.size);
+    for (unsigned int i = 0; i < map.size; i++) {
+        const uint8_t* field = bytes.data() + i * sizeof(uint32_t);
+        result.m_Hashes[i] = static_cast<uint32_t>(field[3]) << 24 | field[2] << 16
+            | field[1] << 8 | field[0];
+        if (!map.at(i)) result.m_Index.emplace(result.m_Hashes[i], i);
+    }
+
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "Device.h"
+#include <unordered_map>
+#include <vector>
+#include <set>
+#include <optional>
+
+
+// Content hashes (CRC32C) of the data blocks, stored after the reference
+// counts as a little-endian uint32_t per data block and indexed in memory
+// by hash. A hash is only a hint: contents are compared before sharing,
+// so stale hashes of blocks reused for other purposes are harmless.
+class DedupIndex {
+    private:
+        std::vector<uint32_t> m_Hashes; // per data block
+        std::unordered_multimap<uint32_t, uint16_t> m_Index; // hash => data block
+        std::set<unsigned int> m_Dirty; // region block indices
+
+    public:
+        static uint32_t hash(const Block& block);
+
+        // A data block in the index with exactly the same contents
+        std::optional<uint16_t> find(Device& device, const Block& block, uint32_t hash) const;
+        void insert(uint16_t blockIndex, uint32_t hash);
+        void erase(uint16_t blockIndex);
+
+        // Writes back the changed hashes
+        void write(Device& device);
+        // Indexes every block that is taken according to the map
+        static DedupIndex read(Device& device, const DeviceBlockMap& map);
+
+        inline unsigned int size() const {
+            return m_Index.size();
+        }
+};
+
+
+#endif
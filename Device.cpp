@@ -1,4 +1,12 @@
 #include "Device.h"
+#include "RamDevice.h"
+#include "ChecksumDevice.h"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 uint16_t Device::BLOCK_SIZE = 8;
@@ -6,90 +14,143 @@ uint16_t Device::FD_BLOCKS_PER_FILE = 10;
 uint16_t Device::MAP_START = 1;
 uint16_t Device::FDS_START = 1;
 uint16_t Device::DATA_START = 1;
-
-
-void Device::writeBlock(std::fstream& file, unsigned int index, const Block& block) {
-    file.seekg(BLOCK_SIZE * index);
-    file.write(reinterpret_cast<const char*>(block.asArray()), BLOCK_SIZE);
+uint16_t Device::REFCOUNTS_START = 1;
+uint16_t Device::HASHES_START = 1;
+uint16_t Device::SNAPSHOTS_START = 1;
+const BlockKernels* Device::KERNELS = &BlockKernels::GENERIC;
+
+void Device::setBlockSize(uint16_t blockSize) {
+    BLOCK_SIZE = blockSize;
+    KERNELS = &BlockKernels::select(blockSize);
 }
 
-void Device::writeBlocks(std::fstream& file, unsigned int shift, const std::vector<Block>& blocks) {
-    file.seekg(BLOCK_SIZE * shift);
-    for (const Block& block : blocks)
-        file.write(reinterpret_cast<const char*>(block.asArray()), BLOCK_SIZE);
+void Device::readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out) {
+    KERNELS->gather(readBlocks(shift, amount), out);
 }
 
-Block Device::readBlock(std::fstream& file, unsigned int index) {
-    uint8_t bytes[BLOCK_SIZE];
-    file.seekg(BLOCK_SIZE * index);
-    file.read(reinterpret_cast<char*>(bytes), BLOCK_SIZE);
 
-    return Block{bytes};
+FileDevice::FileDevice(const std::string& deviceName)
+        : m_Fd(::open(deviceName.c_str(), O_RDWR)),
+        m_DeviceName(deviceName),
+        size(0) {
+    struct stat info;
+    if (m_Fd >= 0 && ::fstat(m_Fd, &info) == 0) size = info.st_size;
+}
+
+FileDevice::~FileDevice() {
+    if (m_Fd >= 0) ::close(m_Fd);
 }
 
-std::vector<Block> Device::readBlocks(std::fstream& file, unsigned int shift, unsigned int amount) {
-    uint8_t bytes[BLOCK_SIZE * amount];
-    file.seekg(BLOCK_SIZE * shift);
-    file.read(reinterpret_cast<char*>(bytes), BLOCK_SIZE * amount);
+void FileDevice::writeBlock(unsigned int index, const Block& block) {
+    writeBlocks(index, {block});
+}
 
-    std::vector<Block> blocks;
-    for (unsigned int i = 0; i < amount; i++) {
-        blocks.emplace_back(bytes + i * BLOCK_SIZE);
+void FileDevice::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
+    std::vector<uint8_t> bytes(blocks.size() * BLOCK_SIZE);
+    KERNELS->gather(blocks, bytes.data());
+    size_t written = 0;
+    while (written < bytes.size()) {
+        const ssize_t result = ::pwrite(m_Fd, bytes.data() + written, bytes.size() - written,
+                static_cast<off_t>(shift) * BLOCK_SIZE + written);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR) continue;
+            throw std::runtime_error("Could not write to " + m_DeviceName);
+        }
+        written += result;
     }
+}
 
-    return blocks;
+Block FileDevice::readBlock(unsigned int index) {
+    return readBlocks(index, 1)[0];
 }
 
-void Device::writeBlock(unsigned int index, const Block& block) {
-    writeBlock(m_Device, index, block);
+std::vector<Block> FileDevice::readBlocks(unsigned int shift, unsigned int amount) {
+    std::vector<uint8_t> bytes(BLOCK_SIZE * amount);
+    readBlocksInto(shift, amount, bytes.data());
+    return KERNELS->scatter(bytes.data(), bytes.size());
 }
 
-void Device::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
-    writeBlocks(m_Device, shift, blocks);
+// Whatever lies past the end of the image reads as zeros
+void FileDevice::readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out) {
+    const size_t size = static_cast<size_t>(BLOCK_SIZE) * amount;
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t result = ::pread(m_Fd, out + done, size - done,
+                static_cast<off_t>(shift) * BLOCK_SIZE + done);
+        if (result == 0) break;
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Could not read from " + m_DeviceName);
+        }
+        done += result;
+    }
+    std::memset(out + done, 0, size - done);
 }
 
-Block Device::readBlock(unsigned int index) {
-    return readBlock(m_Device, index);
+void FileDevice::sync() {
+    ::fsync(m_Fd);
 }
 
-std::vector<Block> Device::readBlocks(unsigned int shift, unsigned int amount) {
-    return readBlocks(m_Device, shift, amount);
+unsigned int Device::imageSize(const DeviceFormat& format) {
+    const unsigned int headerBlocks = ceil(DeviceHeader::sizeInBytes(), format.blockSize);
+    const unsigned int mapBlocks = ceil(format.dataCapacityBlocks, format.blockSize * 8);
+    const unsigned int fdBlocks =
+        format.maxFiles * ((4 + 2 * format.blocksPerFile) / format.blockSize);
+    const unsigned int refCountBlocks = (format.refCounts || format.dedup || format.snapshotSlots > 0)
+        ? ceil(format.dataCapacityBlocks, format.blockSize) : 0;
+    const unsigned int hashBlocks = format.dedup
+        ? ceil(format.dataCapacityBlocks * sizeof(uint32_t), format.blockSize) : 0;
+    const unsigned int snapshotBlocks = format.snapshotSlots
+        * (ceil(DeviceSnapshot::headerSizeInBytes(), format.blockSize) + fdBlocks);
+    const unsigned int blocks = headerBlocks + mapBlocks + fdBlocks + format.dataCapacityBlocks
+        + refCountBlocks + hashBlocks + snapshotBlocks;
+    const unsigned int checksumBlocks =
+        format.checksums ? ChecksumDevice::regionSizeInBlocks(blocks, format.blockSize) : 0;
+    return (blocks + checksumBlocks) * format.blockSize;
 }
 
-void Device::createEmpty(const std::string& name) {
-    std::fstream file(name, file.binary | file.out | file.in);
-    if (!file.is_open()) {
-        std::cout << "Failed to create empty device" << std::endl;
-        return;
-    }
+void Device::format(Device& device, const DeviceFormat& format) {
+    // The FD must occupy whole blocks, and the seeded root dir uses
+    // the first 7 data blocks and 6 pointer slots
+    assert((4 + 2 * format.blocksPerFile) % format.blockSize == 0);
+    assert(format.dataCapacityBlocks % 8 == 0 && format.dataCapacityBlocks >= 8);
+    assert(format.blocksPerFile >= 6 && format.maxFiles >= 3);
+    assert(format.maxFiles <= DeviceFileDescriptor::ENTRY_FD_MASK);
+    assert(device.getSize() >= imageSize(format));
 
     DeviceHeader header;
-    header.blockSize = 8;
-    header.maxFiles = 12;
-    header.blocksPerFile = 10;
-    Device::BLOCK_SIZE = header.blockSize;
+    header.blockSize = format.blockSize;
+    header.maxFiles = format.maxFiles;
+    header.blocksPerFile = format.blocksPerFile;
+    Device::setBlockSize(header.blockSize);
     Device::FD_BLOCKS_PER_FILE = header.blocksPerFile;
-    const unsigned int dataCapacityBlocks = 32;
 
-    Device::MAP_START = 0 + ceil(sizeof(DeviceHeader), Device::BLOCK_SIZE);
-    DeviceBlockMap map(dataCapacityBlocks);
+    Device::MAP_START = 0 + DeviceHeader::sizeInBlocks();
+    DeviceBlockMap map(format.dataCapacityBlocks);
+    if (format.refCounts || format.dedup || format.snapshotSlots > 0) {
+        map.m_RefCounts.assign(format.dataCapacityBlocks, 0);
+        header.refCountBlocks = ceil(format.dataCapacityBlocks, format.blockSize);
+    }
+    if (format.dedup) {
+        header.hashBlocks = ceil(format.dataCapacityBlocks * sizeof(uint32_t), format.blockSize);
+    }
+    header.snapshotSlots = format.snapshotSlots;
 
     Device::FDS_START = Device::MAP_START + map.sizeBlocks();
     std::vector<DeviceFileDescriptor> fds;
     for (unsigned int i = 0; i < header.maxFiles; i++) {
         if (i == 2) {
-            std::vector<uint16_t> addresses(header.blocksPerFile, DeviceFileDescriptor::FREE_BLOCK);
-            addresses[0] = 2;
-            fds.emplace_back(DeviceFileType::Regular, 3, 1, addresses);
-            map.setTaken(2);
+            DeviceFileDescriptor file1(DeviceFileType::Regular, 0, 1, {});
+            file1.setInlineData("BAC");
+            fds.push_back(file1);
         } else if (i == 0) {
             std::vector<uint16_t> addresses(header.blocksPerFile, DeviceFileDescriptor::FREE_BLOCK);
             addresses[0] = 5; // where name is
-            addresses[1] = 0; // fd
+            addresses[1] = DeviceFileDescriptor::toEntry(0, DeviceFileType::Directory);
             addresses[2] = 6; // where name is
-            addresses[3] = 0; // fd
+            addresses[3] = DeviceFileDescriptor::toEntry(0, DeviceFileType::Directory);
             addresses[4] = 3; // where name is
-            addresses[5] = 2; // fd
+            addresses[5] = DeviceFileDescriptor::toEntry(2, DeviceFileType::Regular);
             fds.emplace_back(DeviceFileType::Directory, 3, 2, addresses);
             map.setTaken(3);
             map.setTaken(5);
@@ -99,43 +160,205 @@ void Device::createEmpty(const std::string& name) {
         }
     }
 
-
     Device::DATA_START = Device::FDS_START + fds.size() * DeviceFileDescriptor::sizeInBlocks();
     header.firstLogicalBlockShift = Device::DATA_START;
-    std::vector<uint8_t> data;
-    for (unsigned int i = 0; i < dataCapacityBlocks * header.blockSize; i++) {
-        data.push_back(0);
+    Device::REFCOUNTS_START = Device::DATA_START + format.dataCapacityBlocks;
+    Device::HASHES_START = Device::REFCOUNTS_START + header.refCountBlocks;
+    Device::SNAPSHOTS_START = Device::HASHES_START + header.hashBlocks;
+    // Hashes are left zeroed: they are only trusted after comparing contents.
+    // Zeroed snapshot slots are empty
+    const unsigned int checksumStart = Device::SNAPSHOTS_START
+        + header.snapshotSlots * DeviceSnapshot::slotSizeInBlocks(header.maxFiles);
+    if (format.checksums) {
+        header.checksumBlocks = ChecksumDevice::regionSizeInBlocks(checksumStart, format.blockSize);
     }
+    header.freeBlocks = map.freeBlocks();
+    header.freeDescriptors = std::count_if(fds.begin(), fds.end(),
+            [](const DeviceFileDescriptor& fd) { return fd.fileType == DeviceFileType::Empty; });
 
-    data[2 * header.blockSize + 0] = 66;
-    data[2 * header.blockSize + 1] = 65;
-    data[2 * header.blockSize + 2] = 67;
+    header.write(device);
+    map.write(device);
+    for (unsigned int i = 0; i < fds.size(); i++) {
+        DeviceFileDescriptor::write(device, i, fds[i]);
+    }
 
-    data[3 * header.blockSize + 0] = 'f';
-    data[3 * header.blockSize + 1] = 'i';
-    data[3 * header.blockSize + 2] = 'l';
-    data[3 * header.blockSize + 3] = 'e';
-    data[3 * header.blockSize + 4] = '1';
+    // The rest of the data blocks are expected to be zeroed already
+    device.writeBlock(DATA_START + 3, {"file1"});
+    device.writeBlock(DATA_START + 5, {"."});
+    device.writeBlock(DATA_START + 6, {".."});
 
-    data[5 * header.blockSize + 0] = '.';
+    if (format.checksums) ChecksumDevice::initialize(device, checksumStart);
+}
 
-    data[6 * header.blockSize + 0] = '.';
-    data[6 * header.blockSize + 1] = '.';
+void Device::createEmpty(const std::string& name) {
+    createEmpty(name, DeviceFormat{});
+}
 
-    file.write(reinterpret_cast<char*>(&header), 8);
-    writeBlocks(file, MAP_START, map.serialize());
-    for (unsigned int i = 0; i < fds.size(); i++) {
-        writeBlocks(file, FDS_START + i * DeviceFileDescriptor::sizeInBlocks(), fds[i].serialize());
+void Device::createEmpty(const std::string& name, const DeviceFormat& format) {
+    RamDevice device(imageSize(format));
+    Device::format(device, format);
+    if (!device.dump(name)) {
+        std::cout << "Failed to create empty device" << std::endl;
     }
-    file.write(reinterpret_cast<char*>(data.data()), data.size());
 }
 
 
+DeviceHeader DeviceHeader::read(Device& device) {
+    // The magic, the version and the block size come first, and no block
+    // is smaller than 8 bytes
+    Device::setBlockSize(8);
+    const Block first = device.readBlock(0);
+    const auto firstField = [&first](unsigned int index) {
+        return static_cast<uint16_t>(first[2 * index + 1] << 8 | first[2 * index]);
+    };
+    DeviceHeader header;
+    header.magic = firstField(0);
+    header.version = firstField(1);
+    header.blockSize = firstField(2);
+    if (!header.formatProblem().empty()) return header;
+    Device::setBlockSize(header.blockSize);
+
+    std::vector<uint8_t> bytes;
+    for (const Block& block : device.readBlocks(0, sizeInBlocks())) {
+        bytes.insert(bytes.end(), block.asArray(), block.asArray() + Device::BLOCK_SIZE);
+    }
+    const auto field = [&bytes](unsigned int index) {
+        return static_cast<uint16_t>(bytes[2 * index + 1] << 8 | bytes[2 * index]);
+    };
+
+    header.maxFiles = field(3);
+    header.blocksPerFile = field(4);
+    header.firstLogicalBlockShift = field(5);
+    header.checksumBlocks = field(6);
+    header.refCountBlocks = field(7);
+    header.hashBlocks = field(8);
+    header.snapshotSlots = field(9);
+    header.freeBlocks = field(10);
+    header.freeDescriptors = field(11);
+    return header;
+}
 
+std::string DeviceHeader::formatProblem() const {
+    if (magic != MAGIC) return "Not a file system image, or one formatted before format versions";
+    if (version != VERSION) {
+        return "Image of format version " + std::to_string(version) + ", expecting version "
+            + std::to_string(VERSION) + " (format it again)";
+    }
+    if (blockSize < 8) return "Invalid block size " + std::to_string(blockSize);
+    return "";
+}
+
+void DeviceHeader::write(Device& device) const {
+    std::vector<uint8_t> bytes(sizeInBlocks() * Device::BLOCK_SIZE, 0);
+    const auto field = [&bytes](unsigned int index, uint16_t value) {
+        bytes[2 * index] = (value & 0xFF);
+        bytes[2 * index + 1] = (value >> 8);
+    };
+    field(0, magic);
+    field(1, version);
+    field(2, blockSize);
+    field(3, maxFiles);
+    field(4, blocksPerFile);
+    field(5, firstLogicalBlockShift);
+    field(6, checksumBlocks);
+    field(7, refCountBlocks);
+    field(8, hashBlocks);
+    field(9, snapshotSlots);
+    field(10, freeBlocks);
+    field(11, freeDescriptors);
+
+    std::vector<Block> blocks;
+    for (unsigned int i = 0; i < sizeInBlocks(); i++) {
+        blocks.emplace_back(bytes.data() + i * Device::BLOCK_SIZE);
+    }
+    device.writeBlocks(0, blocks);
+}
+
+
+DeviceLayout DeviceLayout::apply(const DeviceHeader& header, unsigned int deviceSize) {
+    Device::setBlockSize(header.blockSize);
+    Device::FD_BLOCKS_PER_FILE = header.blocksPerFile;
+
+    DeviceLayout layout;
+    layout.blocksForChecksums = header.checksumBlocks;
+    layout.blocksForRefCounts = header.refCountBlocks;
+    layout.blocksForHashes = header.hashBlocks;
+    layout.blocksForSnapshots = header.snapshotSlots * DeviceSnapshot::slotSizeInBlocks(header.maxFiles);
+    // Checksums are kept at the very end, the rest is laid out as if they were not there
+    layout.blocksTotal = deviceSize / Device::BLOCK_SIZE - layout.blocksForChecksums; // floored
+    layout.blocksForHeader = DeviceHeader::sizeInBlocks();
+    layout.blocksForFileDescriptors = header.maxFiles * DeviceFileDescriptor::sizeInBlocks();
+    layout.blocksForMap = [](
+            unsigned int blockSize, unsigned int total,
+            unsigned int header, unsigned int fds) {
+        const unsigned int blockCovers = blockSize * 8;
+        unsigned int mapBlocks = 0;
+        int toCover = total - header - fds;
+        while (toCover > 0) {
+            mapBlocks++;
+            toCover -= (blockCovers + 1); // +1 for extra block dedicated to map
+        }
+        return mapBlocks;
+    }(header.blockSize,
+        layout.blocksTotal - layout.blocksForRefCounts - layout.blocksForHashes - layout.blocksForSnapshots,
+        layout.blocksForHeader, layout.blocksForFileDescriptors);
+    layout.blocksForData = layout.blocksTotal - layout.blocksForHeader
+        - layout.blocksForFileDescriptors - layout.blocksForMap
+        - layout.blocksForRefCounts - layout.blocksForHashes - layout.blocksForSnapshots;
+
+    Device::MAP_START = 0 + layout.blocksForHeader;
+    Device::FDS_START = Device::MAP_START + layout.blocksForMap;
+    Device::DATA_START = Device::FDS_START + layout.blocksForFileDescriptors;
+    Device::REFCOUNTS_START = Device::DATA_START + layout.blocksForData;
+    Device::HASHES_START = Device::REFCOUNTS_START + layout.blocksForRefCounts;
+    Device::SNAPSHOTS_START = Device::HASHES_START + layout.blocksForHashes;
+
+    // A group per map block, fewer if there are not enough descriptors
+    // for each group to get one
+    const unsigned int wanted = std::max(1u, std::min<unsigned int>(
+                ceil(layout.blocksForData, Device::BLOCK_SIZE * 8), header.maxFiles));
+    layout.blocksPerGroup = ceil(ceil(layout.blocksForData, wanted), 8) * 8;
+    layout.groups = std::max(1u, ceil(layout.blocksForData, layout.blocksPerGroup));
+
+    return layout;
+}
+
+
+DeviceBlockMap::DeviceBlockMap(unsigned int size)
+        : m_BlocksUsageMap(size / 8, 0xFF),
+        size(size) {
+    setGroups(size);
+}
 
-DeviceBlockMap::DeviceBlockMap(unsigned int size) : m_BlocksUsageMap(size / 8, 0xFF), size(size) {}
 DeviceBlockMap::DeviceBlockMap(const std::vector<uint8_t>& map, unsigned int size)
-        : m_BlocksUsageMap(map), size(size) {}
+        : m_BlocksUsageMap(map),
+        size(size) {
+    setGroups(size);
+}
+
+void DeviceBlockMap::setGroups(unsigned int blocksPerGroup) {
+    m_BlocksPerGroup = std::max(8u, ceil(std::max(blocksPerGroup, 1u), 8) * 8);
+    const unsigned int count = std::max(1u, ceil(size, m_BlocksPerGroup));
+    m_FreeInGroup.assign(count, 0);
+    countFree();
+}
+
+void DeviceBlockMap::countFree() {
+    std::fill(m_FreeInGroup.begin(), m_FreeInGroup.end(), 0);
+    const unsigned int known = std::min<unsigned int>(size, m_BlocksUsageMap.size() * 8);
+    // A byte at a time, groups are made of whole bytes
+    for (unsigned int byte = 0; byte * 8 < known; byte++) {
+        const unsigned int bits = std::min(8u, known - byte * 8);
+        const uint8_t mask = static_cast<uint8_t>((1u << bits) - 1);
+        m_FreeInGroup[groupOf(byte * 8)] += std::popcount(static_cast<uint8_t>(m_BlocksUsageMap[byte] & mask));
+    }
+}
+
+unsigned int DeviceBlockMap::freeBlocks() const {
+    unsigned int result = 0;
+    for (unsigned int free : m_FreeInGroup) result += free;
+    return result;
+}
 
 bool DeviceBlockMap::operator[](unsigned int blockIndex) const {
     return at(blockIndex);
@@ -146,7 +369,12 @@ void DeviceBlockMap::setFree(unsigned int blockIndex) {
         throw std::out_of_range("blockIndex >= map size");
     const unsigned int byte = blockIndex / 8;
     const unsigned int shift = blockIndex % 8;
+    if ((m_BlocksUsageMap[byte] & (1 << shift)) == 0) m_FreeInGroup[groupOf(blockIndex)]++;
     m_BlocksUsageMap[byte] |= (1 << shift);
+    if (hasRefCounts() && m_RefCounts[blockIndex] != 0) {
+        m_RefCounts[blockIndex] = 0;
+        m_DirtyRefCounts.insert(blockIndex / Device::BLOCK_SIZE);
+    }
 }
 
 void DeviceBlockMap::setTaken(unsigned int blockIndex) {
@@ -154,7 +382,48 @@ void DeviceBlockMap::setTaken(unsigned int blockIndex) {
         throw std::out_of_range("blockIndex >= map size");
     const unsigned int byte = blockIndex / 8;
     const unsigned int shift = blockIndex % 8;
+    if ((m_BlocksUsageMap[byte] & (1 << shift)) != 0) m_FreeInGroup[groupOf(blockIndex)]--;
     m_BlocksUsageMap[byte] ^= (m_BlocksUsageMap[byte] & (1 << shift));
+    if (hasRefCounts() && m_RefCounts[blockIndex] != 1) {
+        m_RefCounts[blockIndex] = 1;
+        m_DirtyRefCounts.insert(blockIndex / Device::BLOCK_SIZE);
+    }
+}
+
+unsigned int DeviceBlockMap::refCount(unsigned int blockIndex) const {
+    if (!hasRefCounts()) return at(blockIndex) ? 0 : 1;
+    if (blockIndex >= size)
+        throw std::out_of_range("blockIndex >= map size");
+    return m_RefCounts[blockIndex];
+}
+
+bool DeviceBlockMap::addRef(unsigned int blockIndex) {
+    if (refCount(blockIndex) == 0)
+        throw std::logic_error("Cannot share a free block");
+    if (!hasRefCounts() || m_RefCounts[blockIndex] == UINT8_MAX) return false;
+    m_RefCounts[blockIndex]++;
+    m_DirtyRefCounts.insert(blockIndex / Device::BLOCK_SIZE);
+    return true;
+}
+
+bool DeviceBlockMap::release(unsigned int blockIndex) {
+    if (refCount(blockIndex) > 1) {
+        m_RefCounts[blockIndex]--;
+        m_DirtyRefCounts.insert(blockIndex / Device::BLOCK_SIZE);
+        return false;
+    }
+    setFree(blockIndex);
+    return true;
+}
+
+void DeviceBlockMap::setRefCount(unsigned int blockIndex, uint8_t count) {
+    if (!hasRefCounts())
+        throw std::logic_error("No reference counts kept");
+    if (blockIndex >= size)
+        throw std::out_of_range("blockIndex >= map size");
+    if (m_RefCounts[blockIndex] == count) return;
+    m_RefCounts[blockIndex] = count;
+    m_DirtyRefCounts.insert(blockIndex / Device::BLOCK_SIZE);
 }
 
 bool DeviceBlockMap::at(unsigned int blockIndex) const {
@@ -167,69 +436,201 @@ bool DeviceBlockMap::at(unsigned int blockIndex) const {
 
 // The tail of the last stored block is unspecified
 std::vector<Block> DeviceBlockMap::serialize() const {
-    std::vector<Block> blocks;
-    std::vector<uint8_t> blockContent(Device::BLOCK_SIZE, 0);
-    for (unsigned int i = 0; i < m_BlocksUsageMap.size(); i++) {
-        const unsigned int shift = i % Device::BLOCK_SIZE;
-        blockContent[shift] = m_BlocksUsageMap[i];
-        if ((shift == 0 && i != 0) || (i == m_BlocksUsageMap.size() - 1)) {
-            blocks.emplace_back(blockContent);
-            blockContent = std::vector<uint8_t>(Device::BLOCK_SIZE, 0);
+    return Device::KERNELS->scatter(m_BlocksUsageMap.data(), m_BlocksUsageMap.size());
+}
+
+void DeviceBlockMap::clear() {
+    m_BlocksUsageMap.clear();
+}
+
+std::optional<unsigned int> DeviceBlockMap::findFreeIn(unsigned int from, unsigned int to,
+        unsigned int count) const {
+    unsigned int runStart = 0;
+    unsigned int runLength = 0;
+    for (unsigned int i = from; i < to; i++) {
+        // Not a single free block in the rest of this group
+        if (i % m_BlocksPerGroup == 0 && m_FreeInGroup[groupOf(i)] == 0) {
+            runLength = 0;
+            i += m_BlocksPerGroup - 1;
+            continue;
+        }
+        // Nor in the next 8 blocks
+        if (i % 8 == 0 && i + 8 <= to && m_BlocksUsageMap[i / 8] == 0) {
+            runLength = 0;
+            i += 7;
+            continue;
+        }
+        if (!at(i)) {
+            runLength = 0;
+            continue;
         }
+        if (runLength++ == 0) runStart = i;
+        if (runLength == count) return {runStart};
     }
+    return std::nullopt;
+}
 
-    return blocks;
+std::optional<unsigned int> DeviceBlockMap::findFree(unsigned int group) const {
+    return findFreeRun(1, group);
 }
 
-void DeviceBlockMap::clear() {
-    m_BlocksUsageMap.clear();
+std::optional<unsigned int> DeviceBlockMap::findFreeRun(unsigned int count, unsigned int group) const {
+    const unsigned int start = std::min(group * m_BlocksPerGroup, size);
+    if (const auto found = findFreeIn(start, size, count)) return found;
+    return findFreeIn(0, std::min(size, start + count - 1), count);
 }
 
-std::optional<unsigned int> DeviceBlockMap::findFree() const {
-    for (unsigned int i = 0; i < size; i++) {
-        if (at(i)) return {i};
+std::optional<unsigned int> DeviceBlockMap::allocate(unsigned int group) {
+    for (unsigned int g = 0; g < groups(); g++) {
+        const unsigned int current = (group + g) % groups();
+        if (m_FreeInGroup[current] == 0) continue;
+        const unsigned int from = current * m_BlocksPerGroup;
+        const auto found = findFreeIn(from, std::min(size, from + m_BlocksPerGroup), 1);
+        if (!found) continue; // past the end of the bitmap
+        setTaken(*found);
+        return found;
     }
-    return std::nullopt; // past the end => invalid
+    return std::nullopt;
 }
 
 void DeviceBlockMap::add(uint8_t byte) {
     m_BlocksUsageMap.push_back(byte);
 }
 
-void DeviceBlockMap::write(Device& device) const {
+void DeviceBlockMap::write(Device& device) {
     device.writeBlocks(Device::MAP_START, serialize());
+    for (unsigned int regionBlock : m_DirtyRefCounts) {
+        const unsigned int from = regionBlock * Device::BLOCK_SIZE;
+        const unsigned int to = std::min<unsigned int>(from + Device::BLOCK_SIZE, m_RefCounts.size());
+        std::vector<uint8_t> bytes(m_RefCounts.begin() + from, m_RefCounts.begin() + to);
+        bytes.resize(Device::BLOCK_SIZE, 0);
+        device.writeBlock(Device::REFCOUNTS_START + regionBlock, {bytes});
+    }
+    m_DirtyRefCounts.clear();
+}
+
+DeviceBlockMap DeviceBlockMap::read(Device& device, unsigned int size, bool withRefCounts) {
+    const unsigned int bitsPerByte = 8;
+    const unsigned int mapBlocks = ceil(size, Device::BLOCK_SIZE * bitsPerByte);
+    DeviceBlockMap result(size);
+    // Whole blocks are read, the tail past the map is dropped
+    result.m_BlocksUsageMap.resize(mapBlocks * Device::BLOCK_SIZE);
+    device.readBlocksInto(Device::MAP_START, mapBlocks, result.m_BlocksUsageMap.data());
+    result.m_BlocksUsageMap.resize(ceil(size, bitsPerByte));
+    result.countFree();
+    if (withRefCounts) {
+        const unsigned int refCountBlocks = ceil(size, Device::BLOCK_SIZE);
+        result.m_RefCounts.resize(refCountBlocks * Device::BLOCK_SIZE);
+        device.readBlocksInto(Device::REFCOUNTS_START, refCountBlocks, result.m_RefCounts.data());
+        result.m_RefCounts.resize(size);
+    }
+
+    return result;
 }
 
 
 const uint16_t DeviceFileDescriptor::FREE_BLOCK = 0xFFFF;
 
+const uint8_t DeviceFileDescriptor::COMPRESSED = 0x1;
+const uint8_t DeviceFileDescriptor::INLINE = 0x2;
+
+const uint16_t DeviceCluster::RAW = 0x8000;
+
 DeviceFileDescriptor::DeviceFileDescriptor()
-        : fileType(DeviceFileType::Empty), size(0), linksCount(0),
+        : fileType(DeviceFileType::Empty), flags(0), size(0), linksCount(0),
         blocks(std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE, FREE_BLOCK)) {}
 
 DeviceFileDescriptor::DeviceFileDescriptor(DeviceFileType fileType, uint16_t size,
         uint8_t linksCount, const std::vector<uint16_t>& blocks)
-        : fileType(fileType), size(size), linksCount(linksCount), blocks(blocks) {}
-
-DeviceFileDescriptor::DeviceFileDescriptor(const std::vector<Block>& rawBlocks) {
-    assert(rawBlocks.size() == sizeInBlocks());
-    fileType = toDeviceFileType(rawBlocks[0][0]);
-    size = static_cast<uint16_t>(rawBlocks[0][2]) << 8 | rawBlocks[0][1];
-    linksCount = rawBlocks[0][3];
-    unsigned int shift = 4;
-    for (const Block& block : rawBlocks) {
-        while (shift < Device::BLOCK_SIZE) {
-            blocks.push_back(static_cast<uint16_t>(block[shift + 1]) << 8 | block[shift]);
-            shift += 2;
-        }
-        shift = 0;
+        : fileType(fileType), flags(0), size(size), linksCount(linksCount), blocks(blocks) {}
+
+// Per thread, reused by every descriptor read or written. Holds the
+// blocks of a record, which are read whole
+static uint8_t* recordBuffer() {
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(DeviceFileDescriptor::sizeInBlocks() * Device::BLOCK_SIZE);
+    return buffer.data();
+}
+
+static const uint8_t* gather(std::span<const Block> rawBlocks) {
+    assert(rawBlocks.size() == DeviceFileDescriptor::sizeInBlocks());
+    uint8_t* record = recordBuffer();
+    Device::KERNELS->gather(rawBlocks, record);
+    return record;
+}
+
+DeviceFileDescriptor::DeviceFileDescriptor(std::span<const Block> rawBlocks)
+        : DeviceFileDescriptor(decode(gather(rawBlocks))) {}
+
+DeviceFileDescriptor DeviceFileDescriptor::decode(const uint8_t* record) {
+    RecordHeader header;
+    std::memcpy(&header, record, sizeof(header));
+    DeviceFileDescriptor result(toDeviceFileType(header.typeAndFlags & 0x0F),
+            littleEndian(header.size), header.linksCount,
+            std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE));
+    result.flags = header.typeAndFlags >> 4;
+    std::memcpy(result.blocks.data(), record + sizeof(header), result.blocks.size() * sizeof(uint16_t));
+    if constexpr (std::endian::native != std::endian::little) {
+        for (uint16_t& addr : result.blocks) addr = littleEndian(addr);
     }
 
+    return result;
+}
+
+void DeviceFileDescriptor::encode(uint8_t* record) const {
+    assert(blocks.size() == Device::FD_BLOCKS_PER_FILE);
+    const RecordHeader header{static_cast<uint8_t>(toInt(fileType) | flags << 4),
+        linksCount, littleEndian(size)};
+    std::memcpy(record, &header, sizeof(header));
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(record + sizeof(header), blocks.data(), blocks.size() * sizeof(uint16_t));
+    } else {
+        for (unsigned int i = 0; i < blocks.size(); i++) {
+            const uint16_t addr = littleEndian(blocks[i]);
+            std::memcpy(record + sizeof(header) + i * sizeof(uint16_t), &addr, sizeof(addr));
+        }
+    }
 }
 
 DeviceFileDescriptor DeviceFileDescriptor::read(Device& device, unsigned int index) {
+    return read(device, index, Device::FDS_START);
+}
+
+DeviceFileDescriptor DeviceFileDescriptor::read(Device& device, unsigned int index, unsigned int tableStart) {
     const unsigned int fdSizeBlocks = DeviceFileDescriptor::sizeInBlocks();
-    return DeviceFileDescriptor(device.readBlocks(Device::FDS_START + index * fdSizeBlocks, fdSizeBlocks));
+    uint8_t* record = recordBuffer();
+    device.readBlocksInto(tableStart + index * fdSizeBlocks, fdSizeBlocks, record);
+    return decode(record);
+}
+
+std::vector<DeviceFileDescriptor> DeviceFileDescriptor::readMany(Device& device,
+        const std::vector<uint16_t>& indices) {
+    const unsigned int fdSizeBlocks = DeviceFileDescriptor::sizeInBlocks();
+    std::vector<uint16_t> sorted = indices;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    std::vector<DeviceFileDescriptor> read;
+    read.reserve(sorted.size());
+    const unsigned int recordBytes = fdSizeBlocks * Device::BLOCK_SIZE;
+    std::vector<uint8_t> bytes;
+    for (unsigned int i = 0; i < sorted.size();) {
+        unsigned int run = 1;
+        while (i + run < sorted.size() && sorted[i + run] == sorted[i] + run) run++;
+        bytes.resize(run * recordBytes);
+        device.readBlocksInto(Device::FDS_START + sorted[i] * fdSizeBlocks, run * fdSizeBlocks, bytes.data());
+        for (unsigned int d = 0; d < run; d++) read.push_back(decode(bytes.data() + d * recordBytes));
+        i += run;
+    }
+
+    std::vector<DeviceFileDescriptor> result;
+    result.reserve(indices.size());
+    for (uint16_t index : indices) {
+        result.push_back(read[std::distance(sorted.begin(),
+                    std::lower_bound(sorted.begin(), sorted.end(), index))]);
+    }
+
+    return result;
 }
 
 void DeviceFileDescriptor::write(
@@ -253,27 +654,183 @@ std::optional<unsigned int> DeviceFileDescriptor::findFree(Device& device) {
     return std::nullopt;
 }
 
+std::vector<uint16_t> DeviceFileDescriptor::findFree(Device& device,
+        unsigned int count, unsigned int from) {
+    const unsigned int fdSizeBlocks = DeviceFileDescriptor::sizeInBlocks();
+    const unsigned int tableSize = (Device::DATA_START - Device::FDS_START) / fdSizeBlocks;
+    std::vector<uint16_t> result;
+    for (unsigned int i = from; i < tableSize && result.size() < count;) {
+        const unsigned int run = std::min(count, tableSize - i);
+        const std::vector<Block> blocks =
+            device.readBlocks(Device::FDS_START + i * fdSizeBlocks, run * fdSizeBlocks);
+        for (unsigned int d = 0; d < run && result.size() < count; d++) {
+            const DeviceFileDescriptor fd(
+                    std::span<const Block>(blocks).subspan(d * fdSizeBlocks, fdSizeBlocks));
+            if (fd.fileType == DeviceFileType::Empty) result.push_back(i + d);
+        }
+        i += run;
+    }
+
+    return result;
+}
+
+DeviceDescriptorMap::DeviceDescriptorMap() : m_PerGroup(1) {}
+
+DeviceDescriptorMap DeviceDescriptorMap::read(Device& device, unsigned int maxFiles, unsigned int groups) {
+    DeviceDescriptorMap result;
+    result.m_Free.assign(maxFiles, false);
+    result.m_PerGroup = std::max(1u, ceil(maxFiles, std::max(groups, 1u)));
+    result.m_FreeInGroup.assign(std::max(1u, ceil(maxFiles, result.m_PerGroup)), 0);
+    for (uint16_t index : DeviceFileDescriptor::findFree(device, maxFiles, 0)) {
+        result.m_Free[index] = true;
+        result.m_FreeInGroup[result.groupOf(index)]++;
+    }
+
+    return result;
+}
+
+std::optional<unsigned int> DeviceDescriptorMap::allocate(unsigned int group) {
+    for (unsigned int g = 0; g < groups(); g++) {
+        const unsigned int current = (group + g) % groups();
+        if (m_FreeInGroup[current] == 0) continue;
+        const unsigned int to = std::min<unsigned int>(m_Free.size(), (current + 1) * m_PerGroup);
+        for (unsigned int index = current * m_PerGroup; index < to; index++) {
+            if (!m_Free[index]) continue;
+            m_Free[index] = false;
+            m_FreeInGroup[current]--;
+            return {index};
+        }
+    }
+    return std::nullopt;
+}
+
+void DeviceDescriptorMap::release(unsigned int index) {
+    if (index >= m_Free.size() || m_Free[index]) return;
+    m_Free[index] = true;
+    m_FreeInGroup[groupOf(index)]++;
+}
+
+unsigned int DeviceDescriptorMap::freeDescriptors() const {
+    unsigned int result = 0;
+    for (unsigned int free : m_FreeInGroup) result += free;
+    return result;
+}
+
+unsigned int DeviceDescriptorMap::emptiestGroup() const {
+    return std::distance(m_FreeInGroup.begin(),
+            std::max_element(m_FreeInGroup.begin(), m_FreeInGroup.end()));
+}
+
 std::vector<Block> DeviceFileDescriptor::serialize() const {
-    std::vector<Block> result;
-
-    Block current;
-    current[0] = toInt(fileType);
-    current[1] = (size & 0xFF);
-    current[2] = (size >> 8);
-    current[3] = linksCount;
-
-    unsigned int index = 4;
-    for (const uint16_t& b : blocks) {
-        current[index] = (b & 0xFF);
-        current[index + 1] = (b >> 8);
-
-        index += 2;
-        if (index % Device::BLOCK_SIZE == 0) {
-            index = 0;
-            result.push_back(current);
-            current = {};
+    uint8_t* record = recordBuffer();
+    encode(record);
+    return Device::KERNELS->scatter(record, sizeInBytes());
+}
+
+std::vector<DeviceCluster> DeviceFileDescriptor::clusters() const {
+    assert(isCompressed());
+    std::vector<DeviceCluster> result;
+    unsigned int i = 0;
+    while (i < blocks.size() && blocks[i] != FREE_BLOCK) {
+        DeviceCluster cluster;
+        cluster.header = blocks[i++];
+        const unsigned int count = ceil(cluster.storedSize(), Device::BLOCK_SIZE);
+        for (unsigned int b = 0; b < count && i < blocks.size(); b++) {
+            cluster.blocks.push_back(blocks[i++]);
+        }
+        result.push_back(cluster);
+    }
+
+    return result;
+}
+
+bool DeviceFileDescriptor::setClusters(const std::vector<DeviceCluster>& clusters) {
+    std::vector<uint16_t> result;
+    for (const DeviceCluster& cluster : clusters) {
+        assert(cluster.blocks.size() == ceil(cluster.storedSize(), Device::BLOCK_SIZE));
+        result.push_back(cluster.header);
+        result.insert(result.end(), cluster.blocks.begin(), cluster.blocks.end());
+    }
+    if (result.size() > Device::FD_BLOCKS_PER_FILE) return false;
+    result.resize(Device::FD_BLOCKS_PER_FILE, FREE_BLOCK);
+    blocks = result;
+
+    return true;
+}
+
+std::string DeviceFileDescriptor::inlineData() const {
+    assert(isInline() && size <= inlineCapacity());
+    std::string result;
+    for (unsigned int i = 0; i < size; i++) {
+        const uint16_t pair = blocks[i / 2];
+        result += static_cast<char>((i % 2 == 0) ? (pair & 0xFF) : (pair >> 8));
+    }
+
+    return result;
+}
+
+void DeviceFileDescriptor::setInlineData(const std::string& data) {
+    assert(data.size() <= inlineCapacity());
+    flags |= INLINE;
+    size = data.size();
+    blocks.assign(Device::FD_BLOCKS_PER_FILE, 0);
+    for (unsigned int i = 0; i < data.size(); i++) {
+        const uint16_t byte = static_cast<uint8_t>(data[i]);
+        blocks[i / 2] |= (i % 2 == 0) ? byte : (byte << 8);
+    }
+}
+
+std::vector<uint16_t> DeviceFileDescriptor::dataBlocks() const {
+    std::vector<uint16_t> result;
+    if (fileType == DeviceFileType::Directory) {
+        for (unsigned int i = 0; i < blocks.size(); i += 2) {
+            if (blocks[i] != FREE_BLOCK) result.push_back(blocks[i]);
+        }
+    } else if (isInline()) {
+        // No blocks at all
+    } else if (isCompressed()) {
+        for (const DeviceCluster& cluster : clusters()) {
+            result.insert(result.end(), cluster.blocks.begin(), cluster.blocks.end());
+        }
+    } else {
+        for (uint16_t addr : blocks) {
+            if (addr != FREE_BLOCK) result.push_back(addr);
         }
     }
 
     return result;
 }
+
+
+DeviceSnapshot DeviceSnapshot::read(Device& device, unsigned int slot, unsigned int maxFiles) {
+    std::vector<uint8_t> bytes;
+    const unsigned int start = Device::SNAPSHOTS_START + slot * slotSizeInBlocks(maxFiles);
+    for (const Block& block : device.readBlocks(start, headerSizeInBlocks())) {
+        bytes.insert(bytes.end(), block.asArray(), block.asArray() + Device::BLOCK_SIZE);
+    }
+
+    DeviceSnapshot snapshot;
+    snapshot.state = (bytes[0] <= static_cast<uint8_t>(State::Deleting))
+        ? static_cast<State>(bytes[0]) : State::Empty;
+    snapshot.reclaimed = static_cast<uint16_t>(bytes[2]) << 8 | bytes[1];
+    for (unsigned int i = 3; i < headerSizeInBytes() && bytes[i] != '\0'; i++) {
+        snapshot.name += static_cast<char>(bytes[i]);
+    }
+
+    return snapshot;
+}
+
+void DeviceSnapshot::write(Device& device, unsigned int slot, unsigned int maxFiles) const {
+    assert(name.size() <= MAX_NAME_SIZE);
+    std::vector<uint8_t> bytes(headerSizeInBlocks() * Device::BLOCK_SIZE, 0);
+    bytes[0] = static_cast<uint8_t>(state);
+    bytes[1] = (reclaimed & 0xFF);
+    bytes[2] = (reclaimed >> 8);
+    std::copy(name.begin(), name.end(), bytes.begin() + 3);
+
+    std::vector<Block> blocks;
+    for (unsigned int i = 0; i < headerSizeInBlocks(); i++) {
+        blocks.emplace_back(bytes.data() + i * Device::BLOCK_SIZE);
+    }
+    device.writeBlocks(Device::SNAPSHOTS_START + slot * slotSizeInBlocks(maxFiles), blocks);
+}
@@ -4,73 +4,182 @@
 #include "Block.h"
 #include <fstream>
 #include <iostream>
+#include <string>
 #include <bitset>
 #include <optional>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include <memory>
+#include <span>
+#include <bit>
 
 
-struct Device {
-    private:
-        std::fstream m_Device;
-        std::string m_DeviceName;
-        const unsigned int size;
-
-        static void writeBlock(std::fstream& file, unsigned int index, const Block& block);
-        static void writeBlocks(std::fstream& file, unsigned int shift, const std::vector<Block>& blocks);
-        static Block readBlock(std::fstream& file, unsigned int index);
-        static std::vector<Block> readBlocks(std::fstream& file, unsigned int shift, unsigned int amount);
+// Block-addressed storage. The layout statics describe the currently
+// mounted (or being created) device.
+struct DeviceFormat;
 
+struct Device {
     public:
         static uint16_t BLOCK_SIZE;
         static uint16_t FD_BLOCKS_PER_FILE;
         static uint16_t MAP_START;
         static uint16_t FDS_START;
         static uint16_t DATA_START;
+        static uint16_t REFCOUNTS_START;
+        static uint16_t HASHES_START;
+        static uint16_t SNAPSHOTS_START;
+        // The block loops specialized for BLOCK_SIZE, if there are any
+        static const BlockKernels* KERNELS;
+
+        // Sets BLOCK_SIZE and KERNELS along with it
+        static void setBlockSize(uint16_t blockSize);
+
+        virtual void writeBlock(unsigned int index, const Block& block) = 0;
+        virtual void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) = 0;
+        virtual Block readBlock(unsigned int index) = 0;
+        virtual std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) = 0;
+        // The contents of the blocks one after the other, into out. Devices
+        // holding the bytes contiguously copy them without a Block each
+        virtual void readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out);
 
-        void writeBlock(unsigned int index, const Block& block);
-        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks);
-        Block readBlock(unsigned int index);
-        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount);
+        // Makes everything written so far persistent
+        virtual void sync() {}
+
+        virtual bool is_open() const = 0;
+        virtual unsigned int getSize() const = 0; // in bytes
 
         inline explicit operator bool() const noexcept {
-            return static_cast<bool>(m_Device);
+            return is_open();
         }
 
-        inline bool is_open() const {
-            return m_Device.is_open();
+        virtual ~Device() = default;
+
+        // Size in bytes of an image with the specified format
+        static unsigned int imageSize(const DeviceFormat& format);
+        // Writes an empty file system (with a few seeded files) onto a
+        // device of at least imageSize() bytes
+        static void format(Device& device, const DeviceFormat& format);
+
+        static void createEmpty(const std::string& name);
+        static void createEmpty(const std::string& name, const DeviceFormat& format);
+};
+
+
+// Device backed by an image file on the host file system. Uses
+// positional I/O, so that concurrent reads do not share a file offset.
+struct FileDevice : public Device {
+    private:
+        int m_Fd; // -1 if the image could not be opened
+        std::string m_DeviceName;
+        unsigned int size;
+
+    public:
+        void writeBlock(unsigned int index, const Block& block) override;
+        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) override;
+        Block readBlock(unsigned int index) override;
+        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) override;
+        void readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out) override;
+
+        void sync() override;
+
+        inline bool is_open() const override {
+            return m_Fd >= 0;
         }
 
-        inline unsigned int getSize() {
+        inline unsigned int getSize() const override {
             return size;
         }
 
-        inline Device(const std::string& deviceName)
-                : m_Device(deviceName, m_Device.binary | m_Device.in
-                                        | m_Device.out | m_Device.ate),
-                m_DeviceName(deviceName),
-                size(m_Device.tellg()) {}
-
-        static void createEmpty(const std::string& name);
+        FileDevice(const std::string& deviceName);
+        FileDevice(const FileDevice&) = delete;
+        FileDevice& operator=(const FileDevice&) = delete;
+        ~FileDevice() override;
 };
 
 
 struct DeviceHeader {
     public:
+        inline constexpr static uint16_t MAGIC = 0x5346; // "FS"
+        // Of the on-disk format, bumped whenever the layout of anything
+        // on the device changes: images of other versions are not mounted.
+        // 1 already stores descriptors as aligned records
+        inline constexpr static uint16_t VERSION = 1;
+
+        uint16_t magic;
+        uint16_t version;
         uint16_t blockSize; // in bytes
         uint16_t maxFiles;
         uint16_t blocksPerFile;
         uint16_t firstLogicalBlockShift;
+        uint16_t checksumBlocks; // at the very end of the device, 0 => no checksums
+        uint16_t refCountBlocks; // right after the data, 0 => single owner per block
+        uint16_t hashBlocks; // after the reference counts, 0 => no deduplication
+        uint16_t snapshotSlots; // after the hashes, 0 => no snapshots
+        // Free space, rewritten along with the block map so that it can be
+        // told without scanning; checked against the map on mount
+        uint16_t freeBlocks;
+        uint16_t freeDescriptors;
 
         inline DeviceHeader()
             : DeviceHeader(0, 0, 0, 0) {}
         inline DeviceHeader(uint16_t blockSize, uint16_t maxFiles,
                 uint16_t blocksPerFile, uint16_t firstLogicalBlockShift)
-            : blockSize(blockSize), maxFiles(maxFiles), blocksPerFile(blocksPerFile),
-            firstLogicalBlockShift(firstLogicalBlockShift) {}
-        inline DeviceHeader(const Block& block)
-            : blockSize(static_cast<uint16_t>(block[1]) << 8 | block[0]),
-              maxFiles(static_cast<uint16_t>(block[3]) << 8 | block[2]),
-              blocksPerFile(static_cast<uint16_t>(block[5]) << 8 | block[4]),
-              firstLogicalBlockShift(static_cast<uint16_t>(block[7]) << 8 | block[6]) {}
+            : magic(MAGIC), version(VERSION), blockSize(blockSize), maxFiles(maxFiles),
+            blocksPerFile(blocksPerFile),
+            firstLogicalBlockShift(firstLogicalBlockShift), checksumBlocks(0),
+            refCountBlocks(0), hashBlocks(0), snapshotSlots(0),
+            freeBlocks(0), freeDescriptors(0) {}
+
+        // All fields are stored as little-endian uint16_t, in declaration order
+        inline static unsigned int sizeInBytes() {
+            return 12 * sizeof(uint16_t);
+        }
+
+        inline static unsigned int sizeInBlocks() {
+            return ceil(sizeInBytes(), Device::BLOCK_SIZE);
+        }
+
+        // Also sets Device::BLOCK_SIZE to the one of the device. Of an image
+        // with a format problem, only the first three fields are read
+        static DeviceHeader read(Device& device);
+        // Why the device cannot be used, empty if it can
+        std::string formatProblem() const;
+        void write(Device& device) const;
+};
+
+// What to put onto a device when formatting it
+struct DeviceFormat {
+    public:
+        uint16_t blockSize = 8;
+        uint16_t maxFiles = 12;
+        uint16_t blocksPerFile = 10;
+        unsigned int dataCapacityBlocks = 32;
+        bool checksums = false;
+        bool refCounts = false; // blocks may be shared between files
+        bool dedup = false; // implies refCounts
+        uint16_t snapshotSlots = 0; // implies refCounts
+};
+
+// Where everything is on a device, derived from its header and size
+struct DeviceLayout {
+    public:
+        unsigned int blocksTotal;
+        unsigned int blocksForHeader;
+        unsigned int blocksForMap;
+        unsigned int blocksForFileDescriptors;
+        unsigned int blocksForData;
+        unsigned int blocksForRefCounts;
+        unsigned int blocksForHashes;
+        unsigned int blocksForSnapshots;
+        unsigned int blocksForChecksums;
+        // Allocation groups: the data blocks are split into slices of
+        // blocksPerGroup, the descriptor table into as many equal shares
+        unsigned int groups;
+        unsigned int blocksPerGroup;
+
+        // Also sets up the Device statics accordingly
+        static DeviceLayout apply(const DeviceHeader& header, unsigned int deviceSize);
 };
 
 class DeviceBlockMap {
@@ -78,6 +187,19 @@ class DeviceBlockMap {
     public:
         std::vector<uint8_t> m_BlocksUsageMap;
         unsigned int size; // amount of significant bits
+        // Per block, empty if the device keeps none. Stored right after the
+        // data blocks; only the region blocks that changed are written back
+        std::vector<uint8_t> m_RefCounts;
+        std::set<unsigned int> m_DirtyRefCounts; // region block indices
+
+        // Allocation groups: consecutive slices of the bitmap, a multiple
+        // of 8 blocks each so that groups never share a byte
+        unsigned int m_BlocksPerGroup;
+        std::vector<unsigned int> m_FreeInGroup;
+
+        void countFree();
+        // Scans [from, to) for a free block, or for the start of count free ones
+        std::optional<unsigned int> findFreeIn(unsigned int from, unsigned int to, unsigned int count) const;
 
     // public:
         /* static unsigned int SIZE_IN_BLOCKS; */
@@ -87,10 +209,24 @@ class DeviceBlockMap {
         void setFree(unsigned int blockIndex);
         void setTaken(unsigned int blockIndex);
 
+        inline bool hasRefCounts() const {
+            return !m_RefCounts.empty();
+        }
+        unsigned int refCount(unsigned int blockIndex) const;
+        // Returns false if the block cannot be shared any further
+        bool addRef(unsigned int blockIndex);
+        // Drops one reference, returns whether the block became free
+        bool release(unsigned int blockIndex);
+        // Overrides the reference count alone (e.g. when repairing), the
+        // bitmap is left as it is
+        void setRefCount(unsigned int blockIndex, uint8_t count);
+
         // The tail of the last block stored is unspecified
         std::vector<Block> serialize() const;
 
-        void write(Device& device) const;
+        void write(Device& device); // also the changed reference counts
+        // size: amount of data blocks covered by the map
+        static DeviceBlockMap read(Device& device, unsigned int size, bool withRefCounts);
 
         void clear();
         void add(uint8_t byte);
@@ -107,7 +243,28 @@ class DeviceBlockMap {
             std::cout << std::endl;
         }
 
-        std::optional<unsigned int> findFree() const;
+        // From the start of group on, then wrapping around. Groups
+        // without free blocks are skipped by their counters
+        std::optional<unsigned int> findFree(unsigned int group = 0) const;
+        // First of count consecutive free blocks
+        std::optional<unsigned int> findFreeRun(unsigned int count, unsigned int group = 0) const;
+        // Finds and takes a free block, in group if it has any. Like the
+        // rest of the map, not synchronized: FileSystem changes it under
+        // the exclusive m_Mutex
+        std::optional<unsigned int> allocate(unsigned int group);
+
+        // Splits the map into groups (a single one until then)
+        void setGroups(unsigned int blocksPerGroup);
+        inline unsigned int groups() const {
+            return m_FreeInGroup.size();
+        }
+        inline unsigned int groupOf(unsigned int blockIndex) const {
+            return blockIndex / m_BlocksPerGroup;
+        }
+        inline unsigned int freeIn(unsigned int group) const {
+            return m_FreeInGroup[group];
+        }
+        unsigned int freeBlocks() const;
 
         DeviceBlockMap(unsigned int size);
         DeviceBlockMap(const std::vector<uint8_t>& map, unsigned int size);
@@ -152,29 +309,130 @@ inline std::ostream& operator<<(std::ostream& stream, const DeviceFileType& dft)
     return stream;
 }
 
+// Data of a compressed file is split into clusters of clusterSize() bytes,
+// each compressed on its own and stored in as many blocks as it needs
+struct DeviceCluster {
+    public:
+        static const uint16_t RAW; // flag: stored uncompressed
+
+        uint16_t header; // stored size in bytes | RAW
+        std::vector<uint16_t> blocks;
+
+        inline uint16_t storedSize() const {
+            return header & ~RAW;
+        }
+
+        inline bool isRaw() const {
+            return (header & RAW) != 0;
+        }
+};
+
+// Values are stored little-endian: a no-op on little-endian hosts
+inline uint16_t littleEndian(uint16_t value) {
+    if constexpr (std::endian::native == std::endian::little) return value;
+    else return static_cast<uint16_t>(value << 8 | value >> 8);
+}
+
 struct DeviceFileDescriptor {
     public:
         static const uint16_t FREE_BLOCK;
 
+        // Start of the on-disk record, followed by the FD_BLOCKS_PER_FILE
+        // block pointers. Every field is naturally aligned, so that a record
+        // is copied in or out at once
+        struct RecordHeader {
+            uint8_t typeAndFlags;
+            uint8_t linksCount;
+            uint16_t size; // little-endian, like the pointers
+        };
+        static_assert(sizeof(RecordHeader) == 4 && alignof(RecordHeader) == alignof(uint16_t));
+
+        // Flags, stored in the high nibble of the file type byte
+        static const uint8_t COMPRESSED;
+        static const uint8_t INLINE; // data kept in place of the block pointers
+
         DeviceFileType fileType;
+        uint8_t flags;
         uint16_t size; // in bytes
         uint8_t linksCount;
+        // For a compressed file: a cluster header followed by the cluster
+        // block pointers, for every cluster in order
         std::vector<uint16_t> blocks;
 
         DeviceFileDescriptor();
         DeviceFileDescriptor(DeviceFileType fileType, uint16_t size,
                 uint8_t linksCount, const std::vector<uint16_t>& blocks);
-        DeviceFileDescriptor(const std::vector<Block>& rawBlocks);
+        DeviceFileDescriptor(std::span<const Block> rawBlocks);
 
         static DeviceFileDescriptor read(Device& device, unsigned int index);
+        // From a copy of the descriptor table starting at block tableStart
+        static DeviceFileDescriptor read(Device& device, unsigned int index, unsigned int tableStart);
+        // In the order of indices, runs of consecutive descriptors are read at once
+        static std::vector<DeviceFileDescriptor> readMany(Device& device,
+                const std::vector<uint16_t>& indices);
         static void write(Device& device, unsigned int index, const DeviceFileDescriptor& dfd);
         static std::optional<unsigned int> findFree(Device& device);
+        // Up to count free descriptors from index from on, the table being
+        // read count descriptors at a time
+        static std::vector<uint16_t> findFree(Device& device, unsigned int count, unsigned int from);
 
         std::vector<Block> serialize() const;
+        // A record of sizeInBytes() bytes
+        void encode(uint8_t* record) const;
+        static DeviceFileDescriptor decode(const uint8_t* record);
+
+        inline bool isCompressed() const {
+            return (flags & COMPRESSED) != 0;
+        }
+
+        inline bool isInline() const {
+            return (flags & INLINE) != 0;
+        }
+
+        // A directory entry is a name block followed by the child's FD index,
+        // whose top bits hold the child's type so that listing needs no
+        // descriptor reads. Entries from before carry no type (Empty)
+        inline constexpr static unsigned int ENTRY_TYPE_SHIFT = 14;
+        inline constexpr static uint16_t ENTRY_FD_MASK = (1 << ENTRY_TYPE_SHIFT) - 1;
+
+        inline static uint16_t toEntry(uint16_t fdIndex, DeviceFileType type) {
+            assert(fdIndex <= ENTRY_FD_MASK);
+            return fdIndex | toInt(type) << ENTRY_TYPE_SHIFT;
+        }
+
+        inline static uint16_t entryFd(uint16_t entry) {
+            return entry & ENTRY_FD_MASK;
+        }
+
+        inline static DeviceFileType entryType(uint16_t entry) {
+            return static_cast<DeviceFileType>(entry >> ENTRY_TYPE_SHIFT);
+        }
+
+        // Bytes that fit into the block pointers area
+        inline static unsigned int inlineCapacity() {
+            return Device::FD_BLOCKS_PER_FILE * sizeof(uint16_t);
+        }
+
+        // The first size bytes of the pointers area
+        std::string inlineData() const;
+        void setInlineData(const std::string& data);
+
+        std::vector<DeviceCluster> clusters() const;
+        // Returns false (and leaves the FD untouched) if they do not fit
+        bool setClusters(const std::vector<DeviceCluster>& clusters);
+
+        // Every data block used by the file (file names for a directory)
+        std::vector<uint16_t> dataBlocks() const;
+
+        // In bytes, before compression
+        inline static unsigned int clusterSize() {
+            const unsigned int maxClusterSize = 16384;
+            const unsigned int blocks = std::max(1u, std::min(8u, maxClusterSize / Device::BLOCK_SIZE));
+            return blocks * Device::BLOCK_SIZE;
+        }
 
         inline static unsigned int sizeInBytes() {
-            return sizeof(fileType) + sizeof(size) + sizeof(linksCount)
-                + Device::FD_BLOCKS_PER_FILE * sizeof(uint16_t);
+            return sizeof(RecordHeader) + Device::FD_BLOCKS_PER_FILE * sizeof(uint16_t);
         }
 
         inline static unsigned int sizeInBlocks() {
@@ -184,12 +442,86 @@ struct DeviceFileDescriptor {
         }
 };
 
+// Which descriptors are free: read from the table once (at mount), then
+// kept up to date in memory by whoever takes or frees one. Split into as
+// many groups as the data blocks, descriptor group g going with data group g
+class DeviceDescriptorMap {
+    private:
+        std::vector<bool> m_Free;
+        unsigned int m_PerGroup;
+        std::vector<unsigned int> m_FreeInGroup;
+
+    public:
+        // The first free one from the start of group on (wrapping around), taken
+        std::optional<unsigned int> allocate(unsigned int group);
+        void release(unsigned int index);
+
+        inline unsigned int groups() const {
+            return m_FreeInGroup.size();
+        }
+        inline unsigned int groupOf(unsigned int index) const {
+            return index / m_PerGroup;
+        }
+        inline unsigned int freeIn(unsigned int group) const {
+            return m_FreeInGroup[group];
+        }
+        unsigned int freeDescriptors() const;
+        // The one with the most free descriptors, to spread directories out
+        unsigned int emptiestGroup() const;
+
+        static DeviceDescriptorMap read(Device& device, unsigned int maxFiles, unsigned int groups);
+
+        DeviceDescriptorMap();
+};
+
+// A frozen copy of the whole descriptor table. It holds a reference on
+// every data block its descriptors point to, so the live file system
+// copies those blocks on write instead of modifying them.
+// Slot layout: a header (state, descriptors already released while
+// deleting, name), then the copy of the table.
+struct DeviceSnapshot {
+    public:
+        enum class State : uint8_t {
+            Empty = 0,
+            Active,
+            Deleting
+        };
+
+        State state = State::Empty;
+        uint16_t reclaimed = 0; // while deleting
+        std::string name;
+
+        inline static unsigned int headerSizeInBytes() {
+            return sizeof(state) + sizeof(reclaimed) + MAX_NAME_SIZE;
+        }
+
+        inline static unsigned int headerSizeInBlocks() {
+            return ceil(headerSizeInBytes(), Device::BLOCK_SIZE);
+        }
+
+        inline static unsigned int slotSizeInBlocks(unsigned int maxFiles) {
+            return headerSizeInBlocks() + maxFiles * DeviceFileDescriptor::sizeInBlocks();
+        }
+
+        // Where the copy of the descriptor table of a slot starts
+        inline static unsigned int tableStart(unsigned int slot, unsigned int maxFiles) {
+            return Device::SNAPSHOTS_START + slot * slotSizeInBlocks(maxFiles) + headerSizeInBlocks();
+        }
+
+        static DeviceSnapshot read(Device& device, unsigned int slot, unsigned int maxFiles);
+        void write(Device& device, unsigned int slot, unsigned int maxFiles) const;
+
+        static const unsigned int MAX_NAME_SIZE = 8;
+};
+
 inline std::ostream& operator<<(std::ostream& stream, const DeviceFileDescriptor& dfd) {
     stream << "Filetype=" << dfd.fileType << std::endl;
     stream << "Size=" << dfd.size
         << (dfd.fileType == DeviceFileType::Directory ? " files" : " bytes")
         << std::endl;
     stream << "Hard links=" << static_cast<int>(dfd.linksCount) << std::endl;
+    if (dfd.isCompressed()) stream << "Compressed" << std::endl;
+    if (dfd.isInline()) stream << "Inline" << std::endl;
     return stream;
 }
 
@@ -3,16 +3,94 @@
 
 FileSystem::FileSystem()
         : m_DeviceBlockMap(0),
-         m_WorkingDirectory(0) {
+         m_WorkingDirectory(0),
+         m_CompressNewFiles(false),
+         m_ReadOnly(false),
+         m_Reclaiming(false),
+         m_Batch(nullptr),
+         m_MapDirty(false),
+         m_Pool(std::make_unique<ThreadPool>(ASYNC_WORKERS)) {
     for (unsigned int i = 0; i < MAX_OPEN_FILES; i++) {
         m_OpenFiles[i] = std::nullopt;
     }
 }
 
+std::future<FsResult<unsigned int>> FileSystem::asyncOpen(std::string path) {
+    return m_Pool->submit([this, path = std::move(path)]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        FsResult<unsigned int> result{FsError::Ok, 0};
+        result.error = open(path, result.value);
+        return result;
+    });
+}
+
+std::future<FsError> FileSystem::asyncClose(unsigned int osFd) {
+    return m_Pool->submit([this, osFd]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        return close(osFd);
+    });
+}
+
+std::future<FsResult<std::string>> FileSystem::asyncRead(unsigned int osFd,
+        unsigned int shift, unsigned int size) {
+    return m_Pool->submit([this, osFd, shift, size]() {
+        std::shared_lock<std::shared_mutex> lock(m_Mutex);
+        FsResult<std::string> result{FsError::Ok, std::string(size, '\0')};
+        result.error = read(osFd, shift, result.value);
+        return result;
+    });
+}
+
+std::future<FsError> FileSystem::asyncWrite(unsigned int osFd, unsigned int shift, std::string data) {
+    return m_Pool->submit([this, osFd, shift, data = std::move(data)]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        return write(osFd, shift, data);
+    });
+}
+
+std::future<FsError> FileSystem::asyncCreate(std::string path) {
+    return m_Pool->submit([this, path = std::move(path)]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        return create(path);
+    });
+}
+
+std::future<FsError> FileSystem::asyncUnlink(std::string path) {
+    return m_Pool->submit([this, path = std::move(path)]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        return unlink(path);
+    });
+}
+
+std::future<FsError> FileSystem::asyncSync() {
+    return m_Pool->submit([this]() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        return sync();
+    });
+}
+
 void FileSystem::createEmptyDevice(const std::string& name) {
     Device::createEmpty(name);
 }
 
+bool FileSystem::mkfs(const std::string& name, const std::vector<std::string>& options) {
+    DeviceFormat format;
+    for (const std::string& option : options) {
+        if (option == "checksums") format.checksums = true;
+        else if (option == "refcounts") format.refCounts = true;
+        else if (option == "dedup") format.dedup = true;
+        else if (option == "snapshots") format.snapshotSlots = SNAPSHOT_SLOTS;
+        else {
+            std::cout << "Unknown format option " << option << std::endl;
+            return false;
+        }
+    }
+    Device::createEmpty(name, format);
+    std::cout << "Created empty device " << name << std::endl;
+
+    return true;
+}
+
 std::pair<std::optional<uint16_t>, std::string>
         FileSystem::extractPath(std::string path) const {
     const bool absolutePath = path[0] == '/';
@@ -26,7 +104,6 @@ std::pair<std::optional<uint16_t>, std::string>
     /* while (path.find_first_of('/') != std::string::npos || enterLast) { */
         const unsigned int sepIndex = path.find_first_of('/');
         const std::string part = path.substr(0, sepIndex); // coult be till the end
-        std::cout << "part=" << part << std::endl;
         path.erase(0, sepIndex); // leave '/' for now
         const auto fdIndexOpt = getFdOfFileWithName(currDir, part);
         const bool atLast = path.find_first_of('/') == std::string::npos;
@@ -34,15 +111,13 @@ std::pair<std::optional<uint16_t>, std::string>
             if (atLast) {
                 return {{currDirIndex}, part};
             } else {
-                std::cout << "Invalid path entry: " << part << std::endl;
                 return {std::nullopt, ""};
             }
         }
         const DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, *fdIndexOpt);
         if (fd.fileType == DeviceFileType::Symlink) {
             if (subsequentSymlinkResolutionCount++ > MAX_SUBSEQUENT_RESOLUTIONS) {
-                std::cout << "Reached limit of symlink resolution" << std::endl;
-                return {std::nullopt, ""};
+                return {std::nullopt, ""}; // likely a loop
             }
             const std::string resolvedName = resolveSymlink(fd);
             path = resolvedName + path;
@@ -76,7 +151,7 @@ std::optional<uint16_t> FileSystem::getFdOfFileWithName(
         const uint16_t fileNamePtr = dir.blocks[i];
         if (fileNamePtr == DeviceFileDescriptor::FREE_BLOCK) continue;
         const std::string currName = m_Device->readBlock(Device::DATA_START + fileNamePtr).asString();
-        if (currName == name) return {dir.blocks[i + 1]};
+        if (currName == name) return {DeviceFileDescriptor::entryFd(dir.blocks[i + 1])};
     }
     return std::nullopt;
 }
@@ -93,36 +168,83 @@ std::string FileSystem::resolveSymlink(const DeviceFileDescriptor& fd) const {
 }
 
 bool FileSystem::remove(const DeviceFileDescriptor& fd, uint16_t fdIndex) {
-    for (uint16_t addr : fd.blocks) {
-        if (addr != DeviceFileDescriptor::FREE_BLOCK) {
-            m_DeviceBlockMap.setFree(addr);
-        }
+    for (uint16_t addr : fd.dataBlocks()) {
+        releaseBlock(addr);
     }
-    m_DeviceBlockMap.write(*m_Device);
+    m_Descriptors.release(fdIndex);
+    writeMap();
 
     DeviceFileDescriptor::write(*m_Device, fdIndex, {});
 
     return true;
 }
 
-bool FileSystem::create(uint16_t dirIndex, DeviceFileDescriptor& dir,
-                std::string name, uint16_t fdIndex) {
-    assert(dir.fileType == DeviceFileType::Directory);
-    if (const unsigned int lastIndex = 2 * dir.size;
-            lastIndex >= Device::FD_BLOCKS_PER_FILE) {
-        std::cout << "Maximum number of files for this dir reached" << std::endl;
+void FileSystem::writeMap() {
+    // Within a batch the map is written once, on commit
+    if (m_Batch) m_MapDirty = true;
+    else m_DeviceBlockMap.write(*m_Device);
+    writeCounters();
+}
+
+void FileSystem::writeCounters() {
+    const uint16_t freeBlocks = m_DeviceBlockMap.freeBlocks();
+    const uint16_t freeDescriptors = m_Descriptors.freeDescriptors();
+    if (freeBlocks == m_DeviceHeader.freeBlocks
+            && freeDescriptors == m_DeviceHeader.freeDescriptors) return;
+    m_DeviceHeader.freeBlocks = freeBlocks;
+    m_DeviceHeader.freeDescriptors = freeDescriptors;
+    // Held back like the map within a batch
+    m_DeviceHeader.write(*m_Device);
+}
+
+bool FileSystem::begin() {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    if (m_Batch) {
+        std::cout << "A batch is already open. Commit it first" << std::endl;
+        return false;
+    }
+    auto batch = std::make_unique<BatchDevice>(std::move(m_Device));
+    m_Batch = batch.get();
+    m_Device = std::move(batch);
+    m_MapDirty = false;
+    std::cout << "Batch open" << std::endl;
+
+    return true;
+}
+
+bool FileSystem::commit() {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
         return false;
     }
-    const auto blockIndexForFileNameOpt = m_DeviceBlockMap.findFree();
-    if (!blockIndexForFileNameOpt) {
-        std::cout << "No empty data blocks left (to store file name), "
-            << "cannot create a new file" << std::endl;
+    if (!m_Batch) {
+        std::cout << "No batch is open" << std::endl;
         return false;
     }
-    if (name.size() > 8) {
-        std::cout << "File name is too long, will be trimmed" << std::endl;
-        name.erase(name.begin() + 8, name.end());
+    if (m_MapDirty) m_DeviceBlockMap.write(*m_Device);
+    const unsigned int writes = m_Batch->heldWrites();
+    const unsigned int blocks = m_Batch->pendingBlocks();
+    m_Batch->apply();
+    m_Device = m_Batch->release();
+    m_Batch = nullptr;
+    std::cout << "Committed " << writes << " metadata block writes as " << blocks << " blocks" << std::endl;
+
+    return true;
+}
+
+FsError FileSystem::create(uint16_t dirIndex, DeviceFileDescriptor& dir,
+                std::string name, uint16_t fdIndex, DeviceFileType type) {
+    assert(dir.fileType == DeviceFileType::Directory);
+    if (const unsigned int lastIndex = 2 * dir.size;
+            lastIndex >= Device::FD_BLOCKS_PER_FILE) {
+        return FsError::DirectoryFull;
     }
+    const auto blockIndexForFileNameOpt = m_DeviceBlockMap.allocate(m_Descriptors.groupOf(dirIndex));
+    if (!blockIndexForFileNameOpt) return FsError::NoSpace;
+    if (name.size() > 8) name.erase(name.begin() + 8, name.end());
 
     // Indices inside FD for file name and file descriptor index
     const unsigned int fdIndexForFileName = std::distance(dir.blocks.begin(),
@@ -132,92 +254,150 @@ bool FileSystem::create(uint16_t dirIndex, DeviceFileDescriptor& dir,
 
     // Store file name data block
     m_Device->writeBlock(Device::DATA_START + *blockIndexForFileNameOpt, {name});
-    m_DeviceBlockMap.setTaken(*blockIndexForFileNameOpt);
-    m_DeviceBlockMap.write(*m_Device);
+    writeMap();
 
     // Put entry into working dir
     dir.blocks[fdIndexForFileName] = *blockIndexForFileNameOpt; // where name is stored
-    dir.blocks[fdIndexForFileFd] = fdIndex; // fd of file
+    dir.blocks[fdIndexForFileFd] = DeviceFileDescriptor::toEntry(fdIndex, type); // fd of file
     dir.size++;
     DeviceFileDescriptor::write(*m_Device, dirIndex, dir);
 
-    return true;
+    return FsError::Ok;
 }
 
 
 
-bool FileSystem::mount(const std::string& deviceName) {
+bool FileSystem::mount(const std::string& deviceName, const std::vector<std::string>& options) {
     if (m_Device) {
         std::cout << "Device " << m_DeviceName << " is mounted. Unmount it first" << std::endl;
         return false;
     }
 
-    m_Device = std::make_unique<Device>(deviceName);
-    if (!m_Device->is_open()) {
+    bool inRam = false;
+    bool compressNewFiles = false;
+    bool writeBack = false;
+    std::optional<std::string> snapshotName;
+    const std::string snapshotOption = "snapshot=";
+    for (const std::string& option : options) {
+        if (option == "ram") inRam = true;
+        else if (option == "compress") compressNewFiles = true;
+        else if (option == "writeback") writeBack = true;
+        else if (option.compare(0, snapshotOption.size(), snapshotOption) == 0) {
+            snapshotName = option.substr(snapshotOption.size());
+        } else {
+            std::cout << "Unknown mount option " << option << std::endl;
+            return false;
+        }
+    }
+    m_CompressNewFiles = compressNewFiles;
+
+    std::unique_ptr<Device> device;
+    if (inRam) device = RamDevice::load(deviceName);
+    else device = std::make_unique<FileDevice>(deviceName);
+    if (!device || !device->is_open()) {
         std::cout << "Could not open device " << deviceName << std::endl;
-        m_Device.release();
         return false;
     }
 
+    if (!mount(std::move(device), deviceName, snapshotName)) return false;
+    if (writeBack) {
+        m_Device = std::make_unique<WriteBackDevice>(std::move(m_Device));
+        std::cout << "Writes are cached and flushed in the background" << std::endl;
+    }
+
+    return true;
+}
+
+bool FileSystem::mountSnapshot(const std::string& name) {
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        const DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, m_DeviceHeader.maxFiles);
+        if (snapshot.state != DeviceSnapshot::State::Active || snapshot.name != name) continue;
+        // Descriptors are read from the frozen table from now on
+        Device::FDS_START = DeviceSnapshot::tableStart(slot, m_DeviceHeader.maxFiles);
+        m_ReadOnly = true;
+        std::cout << "Mounted snapshot " << name << " read-only" << std::endl;
+        return true;
+    }
+
+    std::cout << "No snapshot named " << name << ", unmounting" << std::endl;
+    umount();
+    return false;
+}
+
+bool FileSystem::mount(std::unique_ptr<Device> device, const std::string& deviceName,
+        const std::optional<std::string>& snapshotName) {
+    if (m_Device) {
+        std::cout << "Device " << m_DeviceName << " is mounted. Unmount it first" << std::endl;
+        return false;
+    }
+
+    m_Device = std::move(device);
     m_DeviceName = deviceName;
     const unsigned int actualDeviceSize = m_Device->getSize(); // because was openned at the end
-    if (actualDeviceSize < sizeof(DeviceHeader)) {
+    if (actualDeviceSize < DeviceHeader::sizeInBytes()) {
         std::cout << "Invalid header found. Cannot mount" << std::endl;
-        m_Device.release();
+        m_Device.reset();
         return false;
     }
     std::cout << "Processing header..." << std::endl;
 
-    m_DeviceHeader = {m_Device->readBlock(0)};
-    Device::BLOCK_SIZE = m_DeviceHeader.blockSize;
-    Device::FD_BLOCKS_PER_FILE = m_DeviceHeader.blocksPerFile;
-
-    const unsigned int blocksTotal = actualDeviceSize / Device::BLOCK_SIZE; // floored
-    const unsigned int blocksForHeader = ceil(sizeof(DeviceHeader), Device::BLOCK_SIZE);
-    const unsigned int blocksForFileDescriptors =
-        m_DeviceHeader.maxFiles * DeviceFileDescriptor::sizeInBlocks();
-    const unsigned int blocksForMap = [](
-            unsigned int blockSize, unsigned int total,
-            unsigned int header, unsigned int fds) {
-        const unsigned int blockCovers = blockSize * 8;
-        unsigned int mapBlocks = 0;
-        int toCover = total - header - fds;
-        while (toCover > 0) {
-            mapBlocks++;
-            toCover -= (blockCovers + 1); // +1 for extra block dedicated to map
-        }
-        return mapBlocks;
-    }(m_DeviceHeader.blockSize, blocksTotal, blocksForHeader, blocksForFileDescriptors);
-    const unsigned int blocksLeft =
-        blocksTotal - blocksForHeader - blocksForFileDescriptors - blocksForMap;
-
-    const unsigned int mapShift = ceil(sizeof(DeviceHeader), Device::BLOCK_SIZE);
-    const std::vector<Block> map = m_Device->readBlocks(mapShift, blocksForMap);
-    unsigned int addedCount = 0;
-    m_DeviceBlockMap = {blocksLeft};
-    m_DeviceBlockMap.clear();
-    for (const Block& block : map) {
-        assert(addedCount <= blocksLeft);
-        for (unsigned int i = 0; i < Device::BLOCK_SIZE; i++) {
-            m_DeviceBlockMap.add(block[i]);
-            addedCount += 8;
-            if (addedCount >= blocksLeft) break; // assumes it won't continue the outter loop
-        }
-    }
-
-    Device::MAP_START = 0 + blocksForHeader;
-    Device::FDS_START = Device::MAP_START + blocksForMap;
-    Device::DATA_START = Device::FDS_START + blocksForFileDescriptors;
+    m_DeviceHeader = DeviceHeader::read(*m_Device);
+    const std::string formatProblem = m_DeviceHeader.formatProblem();
+    if (!formatProblem.empty()) {
+        std::cout << formatProblem << ". Cannot mount" << std::endl;
+        m_Device.reset();
+        return false;
+    }
+    const DeviceLayout layout = DeviceLayout::apply(m_DeviceHeader, actualDeviceSize);
+    if (layout.blocksForChecksums > 0) {
+        m_Device = std::make_unique<ChecksumDevice>(std::move(m_Device), layout.blocksTotal);
+    }
+    m_DeviceBlockMap = DeviceBlockMap::read(*m_Device, layout.blocksForData,
+            layout.blocksForRefCounts > 0);
+    m_DeviceBlockMap.setGroups(layout.blocksPerGroup);
+    m_Descriptors = DeviceDescriptorMap::read(*m_Device, m_DeviceHeader.maxFiles, layout.groups);
+    if (layout.blocksForHashes > 0) {
+        m_DedupIndex = std::make_unique<DedupIndex>(DedupIndex::read(*m_Device, m_DeviceBlockMap));
+    }
+    if (snapshotName && !mountSnapshot(*snapshotName)) return false;
+    // Both were just counted anyway, e.g. after a crash between a map write
+    // and the header write
+    if (m_DeviceHeader.freeBlocks != m_DeviceBlockMap.freeBlocks()
+            || m_DeviceHeader.freeDescriptors != m_Descriptors.freeDescriptors()) {
+        m_DeviceHeader.freeBlocks = m_DeviceBlockMap.freeBlocks();
+        m_DeviceHeader.freeDescriptors = m_Descriptors.freeDescriptors();
+        // A snapshot leaves the device untouched, the next writable mount
+        // recounts again
+        if (m_ReadOnly) {
+            std::cout << "Free space counters were stale, recounted in memory" << std::endl;
+        } else {
+            m_DeviceHeader.write(*m_Device);
+            std::cout << "Free space counters were stale, recounted" << std::endl;
+        }
+    }
 
     std::cout << "Block size=" << m_DeviceHeader.blockSize << std::endl;
     std::cout << "Max files=" << m_DeviceHeader.maxFiles << std::endl;
     std::cout << "Max data blocks per file=" << m_DeviceHeader.blocksPerFile << std::endl;
-    std::cout << "Blocks total=" << blocksTotal << std::endl;
-    std::cout << "Blocks for header=" << blocksForHeader << std::endl;
-    std::cout << "Blocks for map=" << blocksForMap << std::endl;
-    std::cout << "Blocks for file descriptors=" << blocksForFileDescriptors
+    std::cout << "Blocks total=" << layout.blocksTotal << std::endl;
+    std::cout << "Blocks for header=" << layout.blocksForHeader << std::endl;
+    std::cout << "Blocks for map=" << layout.blocksForMap << std::endl;
+    std::cout << "Blocks for file descriptors=" << layout.blocksForFileDescriptors
         << "(" << DeviceFileDescriptor::sizeInBlocks() << " per FD)" << std::endl;
-    std::cout << "Blocks left for data=" << blocksLeft << std::endl;
+    std::cout << "Blocks left for data=" << layout.blocksForData << std::endl;
+    std::cout << "Blocks for reference counts=" << layout.blocksForRefCounts << std::endl;
+    std::cout << "Blocks for dedup hashes=" << layout.blocksForHashes << std::endl;
+    std::cout << "Blocks for snapshots=" << layout.blocksForSnapshots
+        << "(" << m_DeviceHeader.snapshotSlots << " slots)" << std::endl;
+    std::cout << "Blocks for checksums=" << layout.blocksForChecksums << std::endl;
+    std::cout << "Allocation groups=" << layout.groups << "(" << layout.blocksPerGroup
+        << " data blocks each)" << std::endl;
+
+    m_Reclaiming = false;
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        const DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, m_DeviceHeader.maxFiles);
+        if (snapshot.state == DeviceSnapshot::State::Deleting) m_Reclaiming = true;
+    }
 
     return true;
 }
@@ -228,12 +408,33 @@ bool FileSystem::umount() {
         return false;
     }
 
+    if (m_Batch) commit();
+    m_Device->sync();
     std::cout << "Successfully unmounted device " << m_DeviceName << std::endl;
 
-    m_Device.release();
+    m_Device.reset();
+    m_DedupIndex.reset();
+    m_ReadOnly = false;
+    m_Reclaiming = false;
+    m_OpenFiles.fill(std::nullopt);
+    m_WorkingDirectory = 0;
     return true;
 }
 
+FsError FileSystem::sync() {
+    if (!m_Device) return FsError::NotMounted;
+    m_Device->sync();
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::usable(bool modifying) const {
+    if (!m_Device) return FsError::NotMounted;
+    if (modifying && m_ReadOnly) return FsError::ReadOnly;
+
+    return FsError::Ok;
+}
+
 bool FileSystem::filestat(unsigned int id) {
     if (!m_Device) {
         std::cout << "No device currently mounted" << std::endl;
@@ -260,282 +461,1623 @@ bool FileSystem::ls() {
         return false;
     }
 
-    DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, m_WorkingDirectory);
-    assert(dir.fileType == DeviceFileType::Directory);
-    for (unsigned int fileIndex = 0; fileIndex < Device::FD_BLOCKS_PER_FILE / 2; fileIndex++) {
-        const uint16_t nameBlock = dir.blocks[fileIndex * 2 + 0];
-        const uint16_t fd = dir.blocks[fileIndex * 2 + 1];
-        if (nameBlock == DeviceFileDescriptor::FREE_BLOCK) {
-            assert(fd == DeviceFileDescriptor::FREE_BLOCK);
-            continue;
+    DirCursor cursor;
+    openCursor(m_WorkingDirectory, cursor);
+    std::vector<DirEntry> batch;
+    do {
+        readdir(cursor, LS_BATCH, batch);
+        for (const DirEntry& entry : batch) {
+            std::cout << "-- " << entry.name << " : fd=" << entry.fdIndex
+                << " (" << entry.type << ")" << std::endl;
+        }
+    } while (!batch.empty());
+
+    return true;
+}
+
+bool FileSystem::map() {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    m_DeviceBlockMap.printState();
+
+    return true;
+}
+
+bool FileSystem::statfs() {
+    FsStat stat;
+    if (const FsError error = statfs(stat); error != FsError::Ok) {
+        std::cout << toString(error) << std::endl;
+        return false;
+    }
+    std::cout << "Block size=" << stat.blockSize << std::endl;
+    std::cout << "Data blocks=" << stat.blocks << "(" << stat.freeBlocks << " free)" << std::endl;
+    std::cout << "File descriptors=" << stat.descriptors
+        << "(" << stat.freeDescriptors << " free)" << std::endl;
+
+    return true;
+}
+
+// Runs of consecutive addresses, in file order
+static unsigned int extentsOf(const std::vector<uint16_t>& blocks) {
+    unsigned int extents = 0;
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        if (i == 0 || blocks[i] != blocks[i - 1] + 1) extents++;
+    }
+    return extents;
+}
+
+FileSystem::Fragmentation FileSystem::fragmentation(const std::vector<DeviceFileDescriptor>& fds) const {
+    Fragmentation result = {0, 0, 0, 0, 0, 0, 0};
+    for (const DeviceFileDescriptor& fd : fds) {
+        if (fd.fileType == DeviceFileType::Empty) continue;
+        const std::vector<uint16_t> blocks = fd.dataBlocks();
+        if (blocks.empty()) continue;
+        const unsigned int extents = extentsOf(blocks);
+        result.files++;
+        if (extents > 1) result.fragmented++;
+        result.extents += extents;
+        result.blocks += blocks.size();
+    }
+
+    unsigned int run = 0;
+    for (unsigned int i = 0; i <= m_DeviceBlockMap.size; i++) {
+        if (i < m_DeviceBlockMap.size && m_DeviceBlockMap.at(i)) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            result.freeBlocks += run;
+            result.freeExtents++;
+            result.largestFree = std::max(result.largestFree, run);
+        }
+        run = 0;
+    }
+
+    return result;
+}
+
+static std::ostream& operator<<(std::ostream& stream, const FileSystem::Fragmentation& fragmentation) {
+    stream << fragmentation.files << " files (" << fragmentation.fragmented << " fragmented) in "
+        << fragmentation.extents << " extents of " << fragmentation.blocks << " blocks, "
+        << fragmentation.freeBlocks << " free blocks in " << fragmentation.freeExtents
+        << " extents (largest " << fragmentation.largestFree << ")";
+    return stream;
+}
+
+bool FileSystem::movable(const std::vector<uint16_t>& blocks) const {
+    return std::all_of(blocks.begin(), blocks.end(),
+            [this](uint16_t addr) { return m_DeviceBlockMap.refCount(addr) == 1; });
+}
+
+void FileSystem::relocate(uint16_t fdIndex, DeviceFileDescriptor& fd, uint16_t to) {
+    const std::vector<uint16_t> from = fd.dataBlocks();
+    const std::vector<uint8_t> bytes = readDataBlocks(from);
+    const std::vector<Block> copy = Device::KERNELS->scatter(bytes.data(), bytes.size());
+    std::map<uint16_t, uint16_t> moved; // old address => new one
+    for (unsigned int i = 0; i < from.size(); i++) {
+        moved[from[i]] = to + i;
+        m_DeviceBlockMap.setTaken(to + i);
+    }
+    writeMap();
+    m_Device->writeBlocks(Device::DATA_START + to, copy);
+
+    if (fd.fileType == DeviceFileType::Directory) {
+        for (unsigned int i = 0; i < fd.blocks.size(); i += 2) {
+            if (fd.blocks[i] != DeviceFileDescriptor::FREE_BLOCK) fd.blocks[i] = moved[fd.blocks[i]];
+        }
+    } else if (fd.isCompressed()) {
+        std::vector<DeviceCluster> clusters = fd.clusters();
+        for (DeviceCluster& cluster : clusters) {
+            for (uint16_t& addr : cluster.blocks) addr = moved[addr];
+        }
+        fd.setClusters(clusters); // as many pointers as before, they fit
+    } else {
+        for (uint16_t& addr : fd.blocks) {
+            if (addr != DeviceFileDescriptor::FREE_BLOCK) addr = moved[addr];
+        }
+    }
+    // The only switch from the old blocks to the copy: until then the
+    // file stays where it was, and after it the old blocks are unused
+    DeviceFileDescriptor::write(*m_Device, fdIndex, fd);
+
+    for (uint16_t addr : from) releaseBlock(addr);
+    // Only plain file data is shared by deduplication
+    const bool plain = fd.fileType == DeviceFileType::Regular && !fd.isCompressed();
+    if (m_DedupIndex && plain) {
+        for (unsigned int i = 0; i < copy.size(); i++) m_DedupIndex->insert(to + i, DedupIndex::hash(copy[i]));
+    }
+    writeMap();
+    if (m_DedupIndex) m_DedupIndex->write(*m_Device);
+}
+
+bool FileSystem::defrag() {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    std::vector<uint16_t> indices(m_DeviceHeader.maxFiles);
+    std::iota(indices.begin(), indices.end(), 0);
+    std::vector<DeviceFileDescriptor> fds = DeviceFileDescriptor::readMany(*m_Device, indices);
+    std::cout << "Before: " << fragmentation(fds) << std::endl;
+
+    unsigned int movedFiles = 0, movedBlocks = 0;
+    const auto move = [&](uint16_t fdIndex, uint16_t to) {
+        movedBlocks += fds[fdIndex].dataBlocks().size();
+        movedFiles++;
+        relocate(fdIndex, fds[fdIndex], to);
+    };
+
+    // Fragmented files into the first free run they fit in
+    std::vector<uint16_t> contiguous;
+    for (uint16_t i = 0; i < fds.size(); i++) {
+        if (fds[i].fileType == DeviceFileType::Empty) continue;
+        const std::vector<uint16_t> blocks = fds[i].dataBlocks();
+        if (blocks.empty() || !movable(blocks)) continue;
+        if (extentsOf(blocks) > 1) {
+            const auto runOpt = m_DeviceBlockMap.findFreeRun(blocks.size(), m_Descriptors.groupOf(i));
+            if (!runOpt) continue; // stays fragmented
+            move(i, *runOpt);
+        }
+        contiguous.push_back(i);
+    }
+
+    // Then the free space together at the end of each allocation group:
+    // from the highest file down, each one into the first hole below it
+    // where it fits, within the group it is in
+    std::sort(contiguous.begin(), contiguous.end(), [&fds](uint16_t a, uint16_t b) {
+        return fds[a].dataBlocks().front() > fds[b].dataBlocks().front();
+    });
+    for (uint16_t i : contiguous) {
+        const std::vector<uint16_t> blocks = fds[i].dataBlocks();
+        const unsigned int group = m_DeviceBlockMap.groupOf(blocks.front());
+        const auto runOpt = m_DeviceBlockMap.findFreeRun(blocks.size(), group);
+        if (runOpt && *runOpt < blocks.front() && m_DeviceBlockMap.groupOf(*runOpt) == group) move(i, *runOpt);
+    }
+
+    std::cout << "After: " << fragmentation(fds) << std::endl;
+    std::cout << "Moved " << movedFiles << " files (" << movedBlocks << " blocks)" << std::endl;
+
+    return true;
+}
+
+// Glob-like: '*' matches any run of characters, '?' any single one
+static bool matches(const std::string& name, const std::string& pattern) {
+    unsigned int n = 0, p = 0;
+    std::optional<unsigned int> star; // last '*' seen and where it started matching
+    unsigned int starMatch = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            n++;
+            p++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            starMatch = n;
+        } else if (star) {
+            p = *star + 1; // let the '*' take one more character
+            n = ++starMatch;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+
+    return p == pattern.size();
+}
+
+bool FileSystem::du(const std::string& path, const std::string& pattern) {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    uint16_t rootIndex = m_WorkingDirectory;
+    if (!path.empty()) {
+        const auto dir_fdName = extractPath(path);
+        const auto fdIndexOpt = dir_fdName.first
+            ? getFdOfFileWithName(DeviceFileDescriptor::read(*m_Device, *dir_fdName.first), dir_fdName.second)
+            : std::nullopt;
+        if (!fdIndexOpt) {
+            std::cout << "No directory " << path << " exists" << std::endl;
+            return false;
+        }
+        rootIndex = *fdIndexOpt;
+    }
+    if (DeviceFileDescriptor::read(*m_Device, rootIndex).fileType != DeviceFileType::Directory) {
+        std::cout << path << " is not a directory" << std::endl;
+        return false;
+    }
+
+    struct Subtree {
+        std::string path;
+        std::optional<unsigned int> parent;
+        unsigned int files;
+        unsigned long long bytes;
+    };
+    // Children are always added after their parent; a deque keeps the
+    // elements in place while others are added
+    std::deque<Subtree> subtrees = {{path.empty() ? "." : path, std::nullopt, 0, 0}};
+    std::mutex subtreesMutex;
+    // Directories reachable twice (hard links) are walked once
+    std::vector<std::atomic<bool>> visited(m_DeviceHeader.maxFiles);
+    visited[rootIndex] = true;
+
+    WorkStealingRunner runner(DU_THREADS);
+    std::function<void(unsigned int, unsigned int, uint16_t)> walk =
+            [&](unsigned int worker, unsigned int subtree, uint16_t dirIndex) {
+        const DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, dirIndex);
+        std::vector<uint16_t> nameBlocks;
+        std::vector<uint16_t> children;
+        for (unsigned int slot = 0; slot + 1 < dir.blocks.size(); slot += 2) {
+            if (dir.blocks[slot] == DeviceFileDescriptor::FREE_BLOCK) continue;
+            nameBlocks.push_back(dir.blocks[slot]);
+            children.push_back(DeviceFileDescriptor::entryFd(dir.blocks[slot + 1]));
+        }
+        // Names and descriptors of all the entries at once
+        const std::vector<std::string> names = readNames(nameBlocks);
+        const std::vector<DeviceFileDescriptor> fds = DeviceFileDescriptor::readMany(*m_Device, children);
+
+        unsigned int files = 0;
+        unsigned long long bytes = 0;
+        for (unsigned int i = 0; i < children.size(); i++) {
+            if (names[i] == "." || names[i] == "..") continue;
+            if (fds[i].fileType == DeviceFileType::Directory) {
+                if (children[i] >= visited.size() || visited[children[i]].exchange(true)) continue;
+                unsigned int child;
+                {
+                    std::lock_guard<std::mutex> lock(subtreesMutex);
+                    child = subtrees.size();
+                    subtrees.push_back({subtrees[subtree].path + "/" + names[i], {subtree}, 0, 0});
+                }
+                runner.spawn(worker, [&walk, child, fdIndex = children[i]](unsigned int worker) {
+                    walk(worker, child, fdIndex);
+                });
+            } else if (pattern.empty() || matches(names[i], pattern)) {
+                files++;
+                bytes += fds[i].size;
+            }
+        }
+        std::lock_guard<std::mutex> lock(subtreesMutex);
+        subtrees[subtree].files += files;
+        subtrees[subtree].bytes += bytes;
+    };
+    runner.run([&walk, rootIndex](unsigned int worker) { walk(worker, 0, rootIndex); });
+
+    // Totals from the leaves up, then by path
+    for (unsigned int i = subtrees.size(); i-- > 1;) {
+        subtrees[*subtrees[i].parent].files += subtrees[i].files;
+        subtrees[*subtrees[i].parent].bytes += subtrees[i].bytes;
+    }
+    std::sort(subtrees.begin(), subtrees.end(),
+            [](const Subtree& a, const Subtree& b) { return a.path < b.path; });
+    for (const Subtree& subtree : subtrees) {
+        std::cout << subtree.files << " files\t" << subtree.bytes << " bytes\t" << subtree.path << std::endl;
+    }
+    std::cout << "Walked " << subtrees.size() << " directories with "
+        << runner.size() << " threads" << std::endl;
+
+    return true;
+}
+
+std::optional<uint16_t> FileSystem::findDirectory(const std::string& path) const {
+    uint16_t index = m_WorkingDirectory;
+    if (!path.empty()) {
+        const auto dir_fdName = extractPath(path);
+        if (!dir_fdName.first) return std::nullopt;
+        const auto fdIndexOpt = getFdOfFileWithName(
+                DeviceFileDescriptor::read(*m_Device, *dir_fdName.first), dir_fdName.second);
+        if (!fdIndexOpt) return std::nullopt;
+        index = *fdIndexOpt;
+    }
+    if (DeviceFileDescriptor::read(*m_Device, index).fileType != DeviceFileType::Directory) {
+        return std::nullopt;
+    }
+
+    return {index};
+}
+
+// An entry on its way between the host and the image
+struct Transfer {
+    std::string path; // relative to the copied directory, '/' separated
+    DeviceFileType type;
+    std::string contents; // of files, target of symlinks
+    std::string problem; // why it cannot be copied, if it cannot
+};
+
+static bool readHostFile(const std::filesystem::path& path, std::string& contents, unsigned int chunkSize) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> chunk(chunkSize);
+    while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0) {
+        contents.append(chunk.data(), file.gcount());
+    }
+    return file.eof();
+}
+
+static bool writeHostFile(const std::filesystem::path& path, std::string_view contents, unsigned int chunkSize) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    while (file && !contents.empty()) {
+        const std::size_t size = std::min<std::size_t>(contents.size(), chunkSize);
+        file.write(contents.data(), size);
+        contents.remove_prefix(size);
+    }
+    file.close();
+    return !file.fail();
+}
+
+bool FileSystem::importTree(const std::string& hostDir, const std::string& path) {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    const auto rootIndexOpt = findDirectory(path);
+    if (!rootIndexOpt) {
+        std::cout << "No directory " << path << " exists" << std::endl;
+        return false;
+    }
+    std::error_code hostError;
+    if (!std::filesystem::is_directory(hostDir, hostError)) {
+        std::cout << "No host directory " << hostDir << " exists" << std::endl;
+        return false;
+    }
+
+    // Host side: walks hostDir, directories before their contents
+    BoundedQueue<Transfer> queue(TRANSFER_QUEUE);
+    std::thread reader([&hostDir, &queue, &hostError]() {
+        namespace fs = std::filesystem;
+        for (auto it = fs::recursive_directory_iterator(hostDir,
+                    fs::directory_options::skip_permission_denied, hostError);
+                !hostError && it != fs::recursive_directory_iterator(); it.increment(hostError)) {
+            Transfer transfer{it->path().lexically_relative(hostDir).generic_string(),
+                DeviceFileType::Empty, "", ""};
+            std::error_code error;
+            if (it->is_symlink(error)) {
+                transfer.type = DeviceFileType::Symlink;
+                transfer.contents = fs::read_symlink(it->path(), error).string();
+            } else if (it->is_directory(error)) {
+                transfer.type = DeviceFileType::Directory;
+            } else if (it->is_regular_file(error)) {
+                transfer.type = DeviceFileType::Regular;
+                // Larger ones cannot fit in a descriptor anyway
+                if (it->file_size(error) > UINT16_MAX) transfer.problem = toString(FsError::FileTooLarge);
+                else if (!readHostFile(it->path(), transfer.contents, TRANSFER_CHUNK)) transfer.problem = "Could not read it";
+            } else {
+                transfer.problem = "Not a file, directory or symlink";
+            }
+            if (error) transfer.problem = error.message();
+            if (!queue.push(std::move(transfer))) break;
+        }
+        queue.close();
+    });
+
+    // Image side, on this thread
+    struct Directory {
+        uint16_t index;
+        DeviceFileDescriptor fd;
+    };
+    std::unordered_map<std::string, Directory> directories = {
+        {"", {*rootIndexOpt, DeviceFileDescriptor::read(*m_Device, *rootIndexOpt)}}};
+    unsigned int files = 0, dirs = 0, links = 0, skipped = 0;
+    unsigned long long bytes = 0;
+    try {
+        while (std::optional<Transfer> transfer = queue.pop()) {
+            const std::size_t slash = transfer->path.rfind('/');
+            const auto parentIt = directories.find(
+                    slash == std::string::npos ? "" : transfer->path.substr(0, slash));
+            if (parentIt == directories.end()) {
+                skipped++; // within a directory that was skipped
+                continue;
+            }
+            Directory& parent = parentIt->second;
+            std::string name = transfer->path.substr(slash == std::string::npos ? 0 : slash + 1);
+            if (name.size() > 8) name.erase(name.begin() + 8, name.end());
+            if (!transfer->problem.empty()) {
+                std::cout << "Skipped " << transfer->path << ": " << transfer->problem << std::endl;
+                skipped++;
+                continue;
+            }
+            if (const auto existing = getFdOfFileWithName(parent.fd, name)) {
+                DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, *existing);
+                if (transfer->type == DeviceFileType::Directory && fd.fileType == DeviceFileType::Directory) {
+                    directories.emplace(transfer->path, Directory{*existing, std::move(fd)});
+                } else {
+                    std::cout << "Skipped " << transfer->path << ": " << name << " already exists" << std::endl;
+                    skipped++;
+                }
+                continue;
+            }
+            if (transfer->type == DeviceFileType::Regular && !m_CompressNewFiles
+                    && transfer->contents.size() > Device::FD_BLOCKS_PER_FILE * Device::BLOCK_SIZE) {
+                std::cout << "Skipped " << transfer->path << ": " << toString(FsError::FileTooLarge) << std::endl;
+                skipped++;
+                continue;
+            }
+
+            // Directories spread out, the rest next to their directory
+            const auto fdIndexOpt = m_Descriptors.allocate(transfer->type == DeviceFileType::Directory
+                    ? m_Descriptors.emptiestGroup() : m_Descriptors.groupOf(parent.index));
+            if (!fdIndexOpt) {
+                std::cout << "Stopped at " << transfer->path << ": "
+                    << toString(FsError::NoFreeDescriptor) << std::endl;
+                break;
+            }
+            const uint16_t fdIndex = *fdIndexOpt;
+
+            FsError error = FsError::Ok;
+            switch (transfer->type) {
+                case DeviceFileType::Directory:
+                    error = makeDirectory(parent.index, parent.fd, name, fdIndex);
+                    if (error != FsError::Ok) break;
+                    directories.emplace(transfer->path,
+                            Directory{fdIndex, DeviceFileDescriptor::read(*m_Device, fdIndex)});
+                    dirs++;
+                    break;
+                case DeviceFileType::Symlink:
+                    error = makeSymlink(parent.index, parent.fd, name, transfer->contents, fdIndex);
+                    if (error == FsError::Ok) links++;
+                    break;
+                default:
+                    error = makeFile(parent.index, parent.fd, name, fdIndex);
+                    if (error != FsError::Ok) break;
+                    {
+                        DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, fdIndex);
+                        // The whole file as one batch
+                        error = writeData(fd, fdIndex, 0, transfer->contents);
+                    }
+                    if (error != FsError::Ok) break;
+                    files++;
+                    bytes += transfer->contents.size();
+                    break;
+            }
+            if (error == FsError::NoSpace) {
+                // The rest would not fit either
+                std::cout << "Stopped at " << transfer->path << ": " << toString(error) << std::endl;
+                break;
+            }
+            if (error != FsError::Ok) {
+                std::cout << "Could not import " << transfer->path << ": " << toString(error) << std::endl;
+                skipped++;
+            }
+        }
+    } catch (...) {
+        queue.close();
+        reader.join();
+        throw;
+    }
+    queue.close();
+    reader.join();
+
+    if (hostError) std::cout << "Could not walk " << hostDir << ": " << hostError.message() << std::endl;
+    std::cout << "Imported " << files << " files, " << dirs << " directories and " << links
+        << " symlinks (" << bytes << " bytes) from " << hostDir << std::endl;
+    if (skipped > 0) std::cout << "Skipped " << skipped << " entries" << std::endl;
+
+    return true;
+}
+
+bool FileSystem::exportTree(const std::string& path, const std::string& hostDir) {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    const auto rootIndexOpt = findDirectory(path);
+    if (!rootIndexOpt) {
+        std::cout << "No directory " << path << " exists" << std::endl;
+        return false;
+    }
+    std::error_code hostError;
+    std::filesystem::create_directories(hostDir, hostError);
+    if (hostError) {
+        std::cout << "Could not create host directory " << hostDir << ": " << hostError.message() << std::endl;
+        return false;
+    }
+
+    // Host side: writes the entries, parents come first
+    BoundedQueue<Transfer> queue(TRANSFER_QUEUE);
+    std::vector<std::string> failures; // only touched by the writer until it is joined
+    std::thread writer([&hostDir, &queue, &failures]() {
+        while (std::optional<Transfer> transfer = queue.pop()) {
+            const std::filesystem::path target = std::filesystem::path(hostDir) / transfer->path;
+            std::error_code error;
+            switch (transfer->type) {
+                case DeviceFileType::Directory:
+                    std::filesystem::create_directory(target, error);
+                    break;
+                case DeviceFileType::Symlink:
+                    std::filesystem::create_symlink(transfer->contents, target, error);
+                    break;
+                default:
+                    if (!writeHostFile(target, transfer->contents, TRANSFER_CHUNK)) {
+                        error = std::make_error_code(std::errc::io_error);
+                    }
+                    break;
+            }
+            if (error) failures.push_back(transfer->path + ": " + error.message());
+        }
+    });
+
+    // Image side, on this thread: depth first, a directory at a time
+    std::vector<std::pair<uint16_t, std::string>> pending = {{*rootIndexOpt, ""}};
+    std::vector<bool> visited(m_DeviceHeader.maxFiles); // directories reachable twice
+    visited[*rootIndexOpt] = true;
+    unsigned int files = 0, dirs = 0, links = 0, skipped = 0;
+    unsigned long long bytes = 0;
+    try {
+        while (!pending.empty()) {
+            const auto [dirIndex, dirPath] = std::move(pending.back());
+            pending.pop_back();
+            const DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, dirIndex);
+            std::vector<uint16_t> nameBlocks;
+            std::vector<uint16_t> children;
+            for (unsigned int slot = 0; slot + 1 < dir.blocks.size(); slot += 2) {
+                if (dir.blocks[slot] == DeviceFileDescriptor::FREE_BLOCK) continue;
+                nameBlocks.push_back(dir.blocks[slot]);
+                children.push_back(DeviceFileDescriptor::entryFd(dir.blocks[slot + 1]));
+            }
+            const std::vector<std::string> names = readNames(nameBlocks);
+            const std::vector<DeviceFileDescriptor> fds = DeviceFileDescriptor::readMany(*m_Device, children);
+
+            for (unsigned int i = 0; i < children.size(); i++) {
+                if (names[i] == "." || names[i] == "..") continue;
+                Transfer transfer{dirPath.empty() ? names[i] : dirPath + "/" + names[i], fds[i].fileType, "", ""};
+                if (fds[i].fileType == DeviceFileType::Directory) {
+                    if (children[i] >= visited.size() || visited[children[i]]) continue;
+                    visited[children[i]] = true;
+                    pending.emplace_back(children[i], transfer.path);
+                    dirs++;
+                } else if (fds[i].fileType == DeviceFileType::Symlink) {
+                    transfer.contents = resolveSymlink(fds[i]);
+                    links++;
+                } else {
+                    transfer.contents.resize(fds[i].size);
+                    if (const FsError error = readData(fds[i], 0, transfer.contents); error != FsError::Ok) {
+                        std::cout << "Could not export " << transfer.path << ": " << toString(error) << std::endl;
+                        skipped++;
+                        continue;
+                    }
+                    files++;
+                    bytes += fds[i].size;
+                }
+                if (!queue.push(std::move(transfer))) break;
+            }
+        }
+    } catch (...) {
+        queue.close();
+        writer.join();
+        throw;
+    }
+    queue.close();
+    writer.join();
+
+    for (const std::string& failure : failures) {
+        std::cout << "Could not write " << failure << std::endl;
+    }
+    std::cout << "Exported " << files << " files, " << dirs << " directories and " << links
+        << " symlinks (" << bytes << " bytes) to " << hostDir << std::endl;
+    if (skipped + failures.size() > 0) {
+        std::cout << "Skipped " << skipped + failures.size() << " entries" << std::endl;
+    }
+
+    return true;
+}
+
+DirCursor::DirCursor() : m_Slot(0) {}
+
+std::vector<unsigned int> DirCursor::slotsFrom(unsigned int slot, unsigned int count) const {
+    std::vector<unsigned int> slots;
+    for (; slot + 1 < m_Dir.blocks.size() && slots.size() < count; slot += 2) {
+        if (m_Dir.blocks[slot] != DeviceFileDescriptor::FREE_BLOCK) slots.push_back(slot);
+    }
+    return slots;
+}
+
+void FileSystem::openCursor(uint16_t dirIndex, DirCursor& cursor) const {
+    cursor.m_Dir = DeviceFileDescriptor::read(*m_Device, dirIndex);
+    cursor.m_Slot = 0;
+}
+
+FsError FileSystem::opendir(std::string_view path, DirCursor& cursor) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    uint16_t dirIndex = m_WorkingDirectory;
+    if (!path.empty()) {
+        const auto dir_fdName = extractPath(std::string(path));
+        if (!dir_fdName.first) return FsError::InvalidPath;
+        const DeviceFileDescriptor parent = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
+        const auto fdIndexOpt = getFdOfFileWithName(parent, dir_fdName.second);
+        if (!fdIndexOpt) return FsError::NotFound;
+        dirIndex = *fdIndexOpt;
+    }
+    if (DeviceFileDescriptor::read(*m_Device, dirIndex).fileType != DeviceFileType::Directory) {
+        return FsError::NotADirectory;
+    }
+    openCursor(dirIndex, cursor);
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::readdir(DirCursor& cursor, unsigned int maxEntries, std::vector<DirEntry>& batch) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    batch.clear();
+    maxEntries = std::max(1u, maxEntries);
+    const std::vector<unsigned int> slots = cursor.slotsFrom(cursor.m_Slot, maxEntries);
+    if (slots.empty()) return FsError::Ok;
+
+    std::vector<uint16_t> addresses;
+    for (unsigned int slot : slots) addresses.push_back(cursor.m_Dir.blocks[slot]);
+    const std::vector<std::string> names = readNames(addresses);
+    cursor.m_Slot = slots.back() + 2;
+
+    for (unsigned int i = 0; i < slots.size(); i++) {
+        const uint16_t entry = cursor.m_Dir.blocks[slots[i] + 1];
+        const uint16_t fdIndex = DeviceFileDescriptor::entryFd(entry);
+        DeviceFileType type = DeviceFileDescriptor::entryType(entry);
+        // Entries written before types were kept in them
+        if (type == DeviceFileType::Empty) type = DeviceFileDescriptor::read(*m_Device, fdIndex).fileType;
+        batch.push_back({names[i], fdIndex, type});
+    }
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::create(std::string_view path) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
+
+    // Find dir
+    const auto dir_fdName = extractPath(std::string(path));
+    if (!dir_fdName.first) return FsError::InvalidPath;
+    DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
+    const std::string name = dir_fdName.second;
+
+    // Find FD for future file, in the group of its directory
+    const auto freeFdOpt = m_Descriptors.allocate(m_Descriptors.groupOf(*dir_fdName.first));
+    if (!freeFdOpt) return FsError::NoFreeDescriptor;
+
+    return makeFile(*dir_fdName.first, dir, name, *freeFdOpt);
+}
+
+FsError FileSystem::makeFile(uint16_t dirIndex, DeviceFileDescriptor& dir,
+        const std::string& name, uint16_t fdIndex) {
+    DeviceFileDescriptor fd(DeviceFileType::Regular, 0, 1,
+            std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK));
+    // Small files live inside their descriptor until they outgrow it
+    if (m_CompressNewFiles) fd.flags |= DeviceFileDescriptor::COMPRESSED;
+    else fd.setInlineData("");
+    DeviceFileDescriptor::write(*m_Device, fdIndex, fd);
+
+    const FsError error = create(dirIndex, dir, name, fdIndex, DeviceFileType::Regular);
+    if (error != FsError::Ok) remove(fd, fdIndex);
+    return error;
+}
+
+FsError FileSystem::statfs(FsStat& stat) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    stat.blockSize = m_DeviceHeader.blockSize;
+    stat.blocks = m_DeviceBlockMap.size;
+    stat.freeBlocks = m_DeviceHeader.freeBlocks;
+    stat.descriptors = m_DeviceHeader.maxFiles;
+    stat.freeDescriptors = m_DeviceHeader.freeDescriptors;
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::open(std::string_view path, unsigned int& osFd) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    const unsigned int freeOsFd = std::distance(m_OpenFiles.begin(),
+            std::find_if(m_OpenFiles.begin(), m_OpenFiles.end(),
+                [](const std::optional<uint16_t>& o){ return !o; }));
+    if (freeOsFd >= m_OpenFiles.size()) return FsError::TooManyOpenFiles;
+
+    const auto dir_fdName = extractPath(std::string(path));
+    if (!dir_fdName.first) return FsError::InvalidPath;
+    DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
+    const std::string name = dir_fdName.second;
+
+    const auto fileFdOpt = getFdOfFileWithName(dir, name);
+    if (!fileFdOpt) return FsError::NotFound;
+    if (std::find(m_OpenFiles.begin(), m_OpenFiles.end(), fileFdOpt) != m_OpenFiles.end()) {
+        return FsError::AlreadyOpen;
+    }
+    m_OpenFiles[freeOsFd] = {*fileFdOpt};
+    osFd = freeOsFd;
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::close(unsigned int osFd) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+    m_OpenFiles[osFd] = std::nullopt;
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::stat(unsigned int osFd, FileStat& stat) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+    const DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[osFd]);
+    stat = {dfd.fileType, dfd.size, dfd.linksCount,
+        static_cast<unsigned int>(dfd.dataBlocks().size())};
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::read(unsigned int osFd, unsigned int shift, std::span<char> buffer) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+
+    const DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[osFd]);
+    return readData(dfd, shift, buffer);
+}
+
+FsError FileSystem::readData(const DeviceFileDescriptor& dfd,
+        unsigned int shift, std::span<char> buff) {
+    assert(dfd.fileType == DeviceFileType::Regular || dfd.fileType == DeviceFileType::Symlink);
+    const unsigned int farEnd = shift + buff.size();
+    if (farEnd > dfd.size) return FsError::OutOfRange;
+    if (dfd.isInline()) {
+        const std::string data = dfd.inlineData();
+        std::copy(data.begin() + shift, data.begin() + farEnd, buff.begin());
+        return FsError::Ok;
+    }
+    if (dfd.isCompressed()) return readCompressed(dfd, shift, buff);
+
+    const ReadSegment segment{shift, buff};
+    return readBlocks(dfd, {&segment, 1});
+}
+
+FsError FileSystem::readv(unsigned int osFd, std::span<const ReadSegment> segments) {
+    if (const FsError error = usable(false); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+
+    const DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[osFd]);
+    for (const ReadSegment& segment : segments) {
+        if (segment.shift + segment.buffer.size() > dfd.size) return FsError::OutOfRange;
+    }
+    if (!dfd.isInline() && !dfd.isCompressed()) return readBlocks(dfd, segments);
+    for (const ReadSegment& segment : segments) {
+        if (const FsError error = readData(dfd, segment.shift, segment.buffer); error != FsError::Ok) {
+            return error;
+        }
+    }
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::readBlocks(const DeviceFileDescriptor& dfd, std::span<const ReadSegment> segments) {
+    const auto whole = [](const ReadSegment& segment, unsigned int b) {
+        return segment.shift <= b * Device::BLOCK_SIZE
+            && segment.shift + segment.buffer.size() >= (b + 1) * Device::BLOCK_SIZE;
+    };
+    // Every block any segment touches only partly, read once in address order
+    std::vector<uint16_t> addresses;
+    for (const ReadSegment& segment : segments) {
+        const unsigned int end = segment.shift + segment.buffer.size();
+        for (unsigned int b = segment.shift / Device::BLOCK_SIZE; b * Device::BLOCK_SIZE < end; b++) {
+            if (dfd.blocks[b] != DeviceFileDescriptor::FREE_BLOCK && !whole(segment, b)) {
+                addresses.push_back(dfd.blocks[b]);
+            }
+        }
+    }
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+    const std::vector<uint8_t> bytes = readDataBlocks(addresses);
+
+    // Holes read as zeros
+    for (const ReadSegment& segment : segments) {
+        const unsigned int end = segment.shift + segment.buffer.size();
+        for (unsigned int b = segment.shift / Device::BLOCK_SIZE; b * Device::BLOCK_SIZE < end;) {
+            const unsigned int blockStart = b * Device::BLOCK_SIZE;
+            const unsigned int from = std::max(segment.shift, blockStart);
+            const unsigned int to = std::min(end, blockStart + Device::BLOCK_SIZE);
+            char* out = segment.buffer.data() + (from - segment.shift);
+            if (dfd.blocks[b] == DeviceFileDescriptor::FREE_BLOCK) {
+                std::fill(out, out + (to - from), '\0');
+                b++;
+                continue;
+            }
+            // Whole blocks go straight into the buffer, consecutive ones at once
+            if (whole(segment, b)) {
+                unsigned int run = 1;
+                while (whole(segment, b + run) && dfd.blocks[b + run] != DeviceFileDescriptor::FREE_BLOCK
+                        && dfd.blocks[b + run] == dfd.blocks[b] + run) {
+                    run++;
+                }
+                m_Device->readBlocksInto(Device::DATA_START + dfd.blocks[b], run,
+                        reinterpret_cast<uint8_t*>(out));
+                b += run;
+                continue;
+            }
+            const unsigned int position = std::distance(addresses.begin(),
+                    std::lower_bound(addresses.begin(), addresses.end(), dfd.blocks[b]));
+            const uint8_t* block = bytes.data() + position * Device::BLOCK_SIZE;
+            std::copy(block + (from - blockStart), block + (to - blockStart), out);
+            b++;
+        }
+    }
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::write(unsigned int osFd, unsigned int shift, std::string_view data) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+    if (data.size() == 0) return FsError::Ok;
+
+    DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[osFd]);
+    return writeData(dfd, *m_OpenFiles[osFd], shift, data);
+}
+
+FsError FileSystem::writev(unsigned int osFd, std::span<const WriteSegment> segments) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
+    if (osFd >= MAX_OPEN_FILES || !m_OpenFiles[osFd]) return FsError::BadFd;
+
+    const uint16_t fdIndex = *m_OpenFiles[osFd];
+    DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, fdIndex);
+    for (const WriteSegment& segment : segments) {
+        if (segment.shift + segment.data.size() > UINT16_MAX) return FsError::FileTooLarge;
+        if (!dfd.isInline() && !dfd.isCompressed()
+                && segment.shift + segment.data.size() > dfd.blocks.size() * Device::BLOCK_SIZE) {
+            return FsError::FileTooLarge;
+        }
+    }
+    if (!dfd.isInline() && !dfd.isCompressed()) return writeBlocks(dfd, fdIndex, segments);
+    // One at a time, an inline file may move into blocks along the way
+    for (const WriteSegment& segment : segments) {
+        if (segment.data.empty()) continue;
+        if (const FsError error = writeData(dfd, fdIndex, segment.shift, segment.data); error != FsError::Ok) {
+            return error;
+        }
+    }
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::writeData(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+        unsigned int shift, std::string_view buff) {
+    assert(dfd.fileType == DeviceFileType::Regular);
+    // Writing past the end leaves a hole, which takes no blocks
+    if (shift + buff.size() > UINT16_MAX) return FsError::FileTooLarge;
+    if (dfd.isInline()) return writeInline(dfd, fdIndex, shift, buff);
+    if (dfd.isCompressed()) return writeCompressed(dfd, fdIndex, shift, buff);
+    if (shift + buff.size() > dfd.blocks.size() * Device::BLOCK_SIZE) return FsError::FileTooLarge;
+
+    const WriteSegment segment{shift, buff};
+    return writeBlocks(dfd, fdIndex, {&segment, 1});
+}
+
+// Later segments win where they overlap
+FsError FileSystem::writeBlocks(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+        std::span<const WriteSegment> segments) {
+    // The touched file blocks, with their old contents where they are kept
+    std::map<unsigned int, Block> contents;
+    std::vector<uint16_t> oldAddresses;
+    unsigned int end = 0;
+    for (const WriteSegment& segment : segments) {
+        if (segment.data.empty()) continue;
+        const unsigned int segmentEnd = segment.shift + segment.data.size();
+        end = std::max(end, segmentEnd);
+        for (unsigned int b = segment.shift / Device::BLOCK_SIZE; b * Device::BLOCK_SIZE < segmentEnd; b++) {
+            const bool whole = segment.shift <= b * Device::BLOCK_SIZE
+                && segmentEnd >= (b + 1) * Device::BLOCK_SIZE;
+            contents.try_emplace(b);
+            if (!whole && dfd.blocks[b] != DeviceFileDescriptor::FREE_BLOCK) {
+                oldAddresses.push_back(dfd.blocks[b]);
+            }
+        }
+    }
+    std::sort(oldAddresses.begin(), oldAddresses.end());
+    oldAddresses.erase(std::unique(oldAddresses.begin(), oldAddresses.end()), oldAddresses.end());
+    const std::vector<uint8_t> oldBytes = readDataBlocks(oldAddresses);
+    for (auto& [blockIndex, data] : contents) {
+        const auto it = std::lower_bound(oldAddresses.begin(), oldAddresses.end(), dfd.blocks[blockIndex]);
+        if (it == oldAddresses.end() || *it != dfd.blocks[blockIndex]) continue;
+        data = Block(oldBytes.data() + std::distance(oldAddresses.begin(), it) * Device::BLOCK_SIZE);
+    }
+    for (const WriteSegment& segment : segments) {
+        const unsigned int segmentEnd = segment.shift + segment.data.size();
+        for (unsigned int b = segment.shift / Device::BLOCK_SIZE; b * Device::BLOCK_SIZE < segmentEnd; b++) {
+            const unsigned int blockStart = b * Device::BLOCK_SIZE;
+            const unsigned int from = std::max(segment.shift, blockStart);
+            const unsigned int to = std::min(segmentEnd, blockStart + Device::BLOCK_SIZE);
+            std::memcpy(contents[b].asArray() + (from - blockStart),
+                    segment.data.data() + (from - segment.shift), to - from);
+        }
+    }
+
+    PendingBlocks pending;
+    bool stored = true;
+    for (const auto& [blockIndex, data] : contents) {
+        const auto storedOpt = storeBlock(dfd.blocks[blockIndex], data, pending, m_Descriptors.groupOf(fdIndex));
+        if (!storedOpt) {
+            stored = false;
+            break;
+        }
+        dfd.blocks[blockIndex] = *storedOpt;
+    }
+    writePending(pending);
+    writeMap();
+    if (m_DedupIndex) m_DedupIndex->write(*m_Device);
+
+    // Even a partial write has to persist the new pointers
+    if (stored) dfd.size = std::max<unsigned int>(dfd.size, end);
+    DeviceFileDescriptor::write(*m_Device, fdIndex, dfd);
+
+    return stored ? FsError::Ok : FsError::NoSpace;
+}
+
+FsError FileSystem::writeInline(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+        unsigned int shift, std::string_view buff) {
+    std::string data = dfd.inlineData();
+    data.resize(std::max<unsigned int>(data.size(), shift + buff.size()));
+    data.replace(shift, buff.size(), buff);
+    if (data.size() <= DeviceFileDescriptor::inlineCapacity()) {
+        dfd.setInlineData(data);
+        DeviceFileDescriptor::write(*m_Device, fdIndex, dfd);
+        return FsError::Ok;
+    }
+
+    // Outgrown the descriptor: move everything into data blocks, keeping
+    // a gap between the old data and the new one a hole
+    const std::string old = dfd.inlineData();
+    DeviceFileDescriptor spilled = dfd;
+    spilled.flags &= ~DeviceFileDescriptor::INLINE;
+    spilled.size = 0;
+    spilled.blocks.assign(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK);
+    FsError error = FsError::Ok;
+    if (shift > old.size()) {
+        if (!old.empty()) error = writeData(spilled, fdIndex, 0, old);
+        if (error == FsError::Ok) error = writeData(spilled, fdIndex, shift, buff);
+    } else {
+        error = writeData(spilled, fdIndex, 0, data);
+    }
+    if (error != FsError::Ok) {
+        for (uint16_t addr : spilled.dataBlocks()) releaseBlock(addr);
+        writeMap();
+        DeviceFileDescriptor::write(*m_Device, fdIndex, dfd);
+        return error;
+    }
+    dfd = spilled;
+
+    return FsError::Ok;
+}
+
+std::optional<uint16_t> FileSystem::storeBlock(uint16_t addr, const Block& data,
+        PendingBlocks& pending, unsigned int group) {
+    uint32_t hash = 0;
+    if (m_DedupIndex) {
+        hash = DedupIndex::hash(data);
+        const auto sameOpt = m_DedupIndex->find(*m_Device, data, hash);
+        if (sameOpt && *sameOpt == addr) return {addr}; // nothing changes
+        if (sameOpt && m_DeviceBlockMap.addRef(*sameOpt)) {
+            if (addr != DeviceFileDescriptor::FREE_BLOCK) releaseBlock(addr);
+            return sameOpt;
+        }
+    }
+
+    uint16_t target = addr;
+    if (addr == DeviceFileDescriptor::FREE_BLOCK || m_DeviceBlockMap.refCount(addr) > 1) {
+        // A new block, or copy-on-write of a shared one
+        const auto freeOpt = m_DeviceBlockMap.allocate(group);
+        if (!freeOpt) return std::nullopt;
+        if (addr != DeviceFileDescriptor::FREE_BLOCK) releaseBlock(addr);
+        target = *freeOpt;
+    } else if (m_DedupIndex) {
+        m_DedupIndex->erase(target); // its old contents are about to go
+    }
+    pending[target] = {data, hash};
+
+    return {target};
+}
+
+void FileSystem::writePending(PendingBlocks& pending) {
+    for (auto it = pending.begin(); it != pending.end();) {
+        // Runs of consecutive blocks at once
+        const uint16_t first = it->first;
+        std::vector<Block> run;
+        for (; it != pending.end() && it->first == first + run.size(); it++) {
+            run.push_back(it->second.first);
+            // Indexed only once written, find() compares against the device
+            if (m_DedupIndex) m_DedupIndex->insert(it->first, it->second.second);
+        }
+        m_Device->writeBlocks(Device::DATA_START + first, run);
+    }
+    pending.clear();
+}
+
+void FileSystem::releaseBlock(uint16_t addr) {
+    if (m_DeviceBlockMap.release(addr) && m_DedupIndex) m_DedupIndex->erase(addr);
+}
+
+std::vector<uint8_t> FileSystem::readDataBlocks(const std::vector<uint16_t>& addresses) {
+    std::vector<uint8_t> bytes(addresses.size() * Device::BLOCK_SIZE);
+    for (unsigned int i = 0; i < addresses.size();) {
+        // Read runs of consecutive blocks at once
+        unsigned int run = 1;
+        while (i + run < addresses.size() && addresses[i + run] == addresses[i] + run) run++;
+        m_Device->readBlocksInto(Device::DATA_START + addresses[i], run,
+                bytes.data() + i * Device::BLOCK_SIZE);
+        i += run;
+    }
+
+    return bytes;
+}
+
+std::vector<std::string> FileSystem::readNames(const std::vector<uint16_t>& addresses) {
+    std::vector<uint16_t> sorted = addresses;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    const std::vector<uint8_t> bytes = readDataBlocks(sorted);
+
+    std::vector<std::string> names;
+    names.reserve(addresses.size());
+    for (uint16_t addr : addresses) {
+        const unsigned int position = std::distance(sorted.begin(),
+                std::lower_bound(sorted.begin(), sorted.end(), addr));
+        // Up to the first NUL, like Block::asString
+        const char* name = reinterpret_cast<const char*>(bytes.data() + position * Device::BLOCK_SIZE);
+        names.emplace_back(name, std::find(name, name + Device::BLOCK_SIZE, '\0'));
+    }
+
+    return names;
+}
+
+FsError FileSystem::readCluster(const DeviceCluster& cluster,
+        unsigned int rawSize, std::vector<uint8_t>& raw) {
+    raw.assign(rawSize, 0);
+    if (cluster.storedSize() == 0) return FsError::Ok; // all zeros
+    const std::vector<uint8_t> stored = readDataBlocks(cluster.blocks);
+    if (cluster.isRaw()) {
+        std::copy(stored.begin(), stored.begin() + std::min<unsigned int>(rawSize, cluster.storedSize()),
+                raw.begin());
+        return FsError::Ok;
+    }
+    if (!lzDecompress(stored.data(), cluster.storedSize(), raw.data(), rawSize)) {
+        return FsError::Corrupted;
+    }
+
+    return FsError::Ok;
+}
+
+FsError FileSystem::readCompressed(const DeviceFileDescriptor& dfd,
+        unsigned int shift, std::span<char> buff) {
+    const unsigned int clusterSize = DeviceFileDescriptor::clusterSize();
+    const std::vector<DeviceCluster> clusters = dfd.clusters();
+    const unsigned int end = shift + buff.size();
+    std::vector<uint8_t> raw;
+    for (unsigned int c = shift / clusterSize; c * clusterSize < end; c++) {
+        const unsigned int clusterStart = c * clusterSize;
+        const unsigned int rawSize = std::min(clusterSize, dfd.size - clusterStart);
+        if (c >= clusters.size()) {
+            raw.assign(rawSize, 0);
+        } else if (const FsError error = readCluster(clusters[c], rawSize, raw); error != FsError::Ok) {
+            return error;
+        }
+
+        const unsigned int from = std::max(shift, clusterStart);
+        const unsigned int to = std::min(end, clusterStart + rawSize);
+        std::copy(raw.begin() + (from - clusterStart), raw.begin() + (to - clusterStart),
+                buff.begin() + (from - shift));
+    }
+
+    return FsError::Ok;
+}
+
+// Every touched cluster is recompressed into freshly allocated blocks,
+// the old blocks are released only once the new ones are written
+FsError FileSystem::writeCompressed(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+        unsigned int shift, std::string_view buff) {
+    const unsigned int clusterSize = DeviceFileDescriptor::clusterSize();
+    const unsigned int oldSize = dfd.size;
+    const unsigned int newSize = std::max<unsigned int>(oldSize, shift + buff.size());
+    std::vector<DeviceCluster> clusters = dfd.clusters();
+    clusters.resize(ceil(newSize, clusterSize), DeviceCluster{0, {}});
+
+    // The clusters being written, plus the old last one if it grows
+    std::vector<unsigned int> touched;
+    if (oldSize % clusterSize != 0 && (oldSize - 1) / clusterSize < shift / clusterSize) {
+        touched.push_back((oldSize - 1) / clusterSize);
+    }
+    for (unsigned int c = shift / clusterSize; c <= (shift + buff.size() - 1) / clusterSize; c++) {
+        touched.push_back(c);
+    }
+    std::vector<std::vector<uint8_t>> stored;
+    std::vector<uint16_t> oldBlocks;
+    std::vector<uint8_t> raw;
+    for (unsigned int c : touched) {
+        const unsigned int clusterStart = c * clusterSize;
+        const unsigned int oldRawSize = (clusterStart < oldSize)
+            ? std::min(clusterSize, oldSize - clusterStart) : 0;
+        if (const FsError error = readCluster(clusters[c], oldRawSize, raw); error != FsError::Ok) {
+            return error;
+        }
+        raw.resize(std::min(clusterSize, newSize - clusterStart), 0);
+
+        const unsigned int from = std::max(shift, clusterStart);
+        const unsigned int to = std::min<unsigned int>(shift + buff.size(), clusterStart + raw.size());
+        if (from < to) {
+            std::copy(buff.begin() + (from - shift), buff.begin() + (to - shift),
+                    raw.begin() + (from - clusterStart));
+        }
+
+        DeviceCluster& cluster = clusters[c];
+        oldBlocks.insert(oldBlocks.end(), cluster.blocks.begin(), cluster.blocks.end());
+        if (std::all_of(raw.begin(), raw.end(), [](uint8_t byte) { return byte == 0; })) {
+            cluster = {0, {}}; // a hole
+            stored.emplace_back();
+            continue;
+        }
+        std::vector<uint8_t> compressed = lzCompress(raw.data(), raw.size());
+        if (compressed.size() < raw.size()) {
+            cluster.header = compressed.size();
+            stored.push_back(std::move(compressed));
+        } else {
+            cluster.header = raw.size() | DeviceCluster::RAW;
+            stored.push_back(raw);
+        }
+        cluster.blocks.assign(ceil(cluster.storedSize(), Device::BLOCK_SIZE),
+                DeviceFileDescriptor::FREE_BLOCK);
+    }
+    if (DeviceFileDescriptor probe = dfd; !probe.setClusters(clusters)) return FsError::FileTooLarge;
+
+    // Allocate
+    std::vector<uint16_t> newBlocks;
+    for (unsigned int c : touched) {
+        for (uint16_t& addr : clusters[c].blocks) {
+            const auto freeOpt = m_DeviceBlockMap.allocate(m_Descriptors.groupOf(fdIndex));
+            if (!freeOpt) {
+                for (uint16_t taken : newBlocks) m_DeviceBlockMap.setFree(taken);
+                return FsError::NoSpace;
+            }
+            addr = *freeOpt;
+            newBlocks.push_back(addr);
+        }
+    }
+
+    // Write the new data, then switch the FD over and release the old blocks
+    for (unsigned int t = 0; t < touched.size(); t++) {
+        const std::vector<Block> blocks = Device::KERNELS->scatter(stored[t].data(), stored[t].size());
+        const std::vector<uint16_t>& addresses = clusters[touched[t]].blocks;
+        for (unsigned int b = 0; b < addresses.size(); b++) {
+            m_Device->writeBlock(Device::DATA_START + addresses[b], blocks[b]);
+        }
+    }
+    dfd.setClusters(clusters);
+    dfd.size = newSize;
+    DeviceFileDescriptor::write(*m_Device, fdIndex, dfd);
+    for (uint16_t addr : oldBlocks) releaseBlock(addr);
+    writeMap();
+
+    return FsError::Ok;
+}
+
+std::optional<unsigned int> FileSystem::seek(const DeviceFileDescriptor& dfd,
+        unsigned int offset, bool data) const {
+    if (offset >= dfd.size) return std::nullopt;
+    if (dfd.isInline()) return {data ? offset : dfd.size};
+
+    // Allocation is tracked per block, or per cluster for compressed files
+    const std::vector<DeviceCluster> clusters =
+        dfd.isCompressed() ? dfd.clusters() : std::vector<DeviceCluster>{};
+    const unsigned int unit = dfd.isCompressed() ? DeviceFileDescriptor::clusterSize() : Device::BLOCK_SIZE;
+    const auto allocated = [&](unsigned int index) {
+        if (dfd.isCompressed()) return index < clusters.size() && clusters[index].storedSize() > 0;
+        return dfd.blocks[index] != DeviceFileDescriptor::FREE_BLOCK;
+    };
+    for (unsigned int index = offset / unit; index * unit < dfd.size; index++) {
+        if (allocated(index) == data) return {std::max(offset, index * unit)};
+    }
+
+    // There is an implicit hole at the end of every file
+    if (data) return std::nullopt;
+    return {dfd.size};
+}
+
+bool FileSystem::seek(unsigned int fd, const std::string& whence, unsigned int offset) {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+    if (fd >= MAX_OPEN_FILES || !m_OpenFiles[fd]) {
+        std::cout << "No file with os_fd=" << fd << " currently open" << std::endl;
+        return false;
+    }
+
+    const DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[fd]);
+    const auto resultOpt = seek(dfd, offset, whence == "data");
+    if (!resultOpt) {
+        std::cout << "No " << whence << " at or after " << offset << std::endl;
+        return false;
+    }
+    std::cout << "Next " << whence << " at " << *resultOpt << std::endl;
+
+    return true;
+}
+
+bool FileSystem::fallocate(const std::string& path, unsigned int size) {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
+        return false;
+    }
+
+    const auto dir_fdName = extractPath(path);
+    if (!dir_fdName.first) {
+        std::cout << "Invalid path" << std::endl;
+        return false;
+    }
+    const DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
+    const auto fdIndexOpt = getFdOfFileWithName(dir, dir_fdName.second);
+    if (!fdIndexOpt) {
+        std::cout << "No file with this name exists" << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, *fdIndexOpt);
+    if (fd.fileType != DeviceFileType::Regular || fd.isCompressed()) {
+        std::cout << "Only uncompressed regular files can be preallocated" << std::endl;
+        return false;
+    }
+    if (size > UINT16_MAX || ceil(size, Device::BLOCK_SIZE) > Device::FD_BLOCKS_PER_FILE) {
+        std::cout << "File cannot be larger than "
+            << std::min<unsigned int>(UINT16_MAX, Device::FD_BLOCKS_PER_FILE * Device::BLOCK_SIZE)
+            << " bytes" << std::endl;
+        return false;
+    }
+
+    // Inline data moves into the reserved blocks
+    std::string inlined;
+    if (fd.isInline()) {
+        inlined = fd.inlineData();
+        fd.flags &= ~DeviceFileDescriptor::INLINE;
+        fd.size = 0;
+        fd.blocks.assign(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK);
+    }
+
+    std::vector<unsigned int> missing; // pointer slots to fill
+    for (unsigned int i = 0; i < ceil(size, Device::BLOCK_SIZE); i++) {
+        if (fd.blocks[i] == DeviceFileDescriptor::FREE_BLOCK) missing.push_back(i);
+    }
+
+    // A single run if there is one, otherwise whatever is free
+    std::vector<uint16_t> reserved;
+    if (const auto runOpt = m_DeviceBlockMap.findFreeRun(missing.size(), m_Descriptors.groupOf(*fdIndexOpt));
+            runOpt) {
+        for (unsigned int i = 0; i < missing.size(); i++) reserved.push_back(*runOpt + i);
+    } else {
+        for (unsigned int i = 0; i < m_DeviceBlockMap.size && reserved.size() < missing.size(); i++) {
+            if (m_DeviceBlockMap.at(i)) reserved.push_back(i);
+        }
+        if (reserved.size() < missing.size()) {
+            std::cout << "Not enough free data blocks left, cannot preallocate" << std::endl;
+            return false;
+        }
+    }
+
+    // Reserved blocks read as zeros, like holes did
+    for (unsigned int i = 0; i < reserved.size();) {
+        unsigned int run = 1;
+        while (i + run < reserved.size() && reserved[i + run] == reserved[i] + run) run++;
+        m_Device->writeBlocks(Device::DATA_START + reserved[i], std::vector<Block>(run));
+        i += run;
+    }
+    for (unsigned int i = 0; i < missing.size(); i++) {
+        m_DeviceBlockMap.setTaken(reserved[i]);
+        fd.blocks[missing[i]] = reserved[i];
+    }
+    writeMap();
+    fd.size = std::max<unsigned int>(fd.size, size);
+    if (!inlined.empty()) {
+        if (const FsError error = writeData(fd, *fdIndexOpt, 0, inlined); error != FsError::Ok) {
+            std::cout << toString(error) << std::endl;
+            return false;
         }
-        const std::string name = m_Device->readBlock(Device::DATA_START + nameBlock).asString();
-
-        std::cout << "-- " << name << " : fd=" << fd << std::endl;
     }
-
-    m_DeviceBlockMap.printState();
+    DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
+    std::cout << "Preallocated " << reserved.size() << " blocks for " << path << std::endl;
 
     return true;
 }
 
-bool FileSystem::create(std::string path) {
+bool FileSystem::compress(const std::string& path, bool enable) {
     if (!m_Device) {
         std::cout << "No device currently mounted" << std::endl;
         return false;
     }
 
-    // Find dir
     const auto dir_fdName = extractPath(path);
     if (!dir_fdName.first) {
-        std::cout << "Invalid path, cannot create file" << std::endl;
+        std::cout << "Invalid path" << std::endl;
         return false;
     }
-    DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
-    const std::string name = dir_fdName.second;
-
-    // Find FD for future file
-    const auto freeFdOpt = DeviceFileDescriptor::findFree(*m_Device);
-    if (!freeFdOpt) {
-        std::cout << "No empty FD left, cannot create a new file" << std::endl;
+    const DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
+    const auto fdIndexOpt = getFdOfFileWithName(dir, dir_fdName.second);
+    if (!fdIndexOpt) {
+        std::cout << "No file with this name exists" << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, *fdIndexOpt);
+    if (fd.fileType != DeviceFileType::Regular) {
+        std::cout << "Only regular files can be compressed" << std::endl;
         return false;
     }
+    if (fd.isCompressed() == enable) {
+        std::cout << "Nothing to do" << std::endl;
+        return true;
+    }
 
-    // Create file inside found FD
-    /* const std::string name = extractName(path); */
-    DeviceFileDescriptor fd(DeviceFileType::Regular, 0, 1,
+    // Rewrite the contents in the new representation
+    std::string contents(fd.size, '\0');
+    if (const FsError error = readData(fd, 0, contents); error != FsError::Ok) {
+        std::cout << toString(error) << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor converted(DeviceFileType::Regular, 0, fd.linksCount,
             std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK));
-    DeviceFileDescriptor::write(*m_Device, *freeFdOpt, fd);
-
-    const bool result = create(*dir_fdName.first, dir, name, *freeFdOpt);
-    if (!result) return false;
-    std::cout << "Created new file with FD=" << *freeFdOpt << std::endl;
+    if (enable) converted.flags = DeviceFileDescriptor::COMPRESSED;
+    else converted.setInlineData(""); // moves into blocks once it outgrows the FD
+    if (const FsError error = contents.empty() ? FsError::Ok : writeData(converted, *fdIndexOpt, 0, contents);
+            error != FsError::Ok) {
+        // Release whatever the partial conversion has taken
+        for (uint16_t addr : converted.dataBlocks()) releaseBlock(addr);
+        writeMap();
+        DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
+        std::cout << toString(error) << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, converted);
+    for (uint16_t addr : fd.dataBlocks()) releaseBlock(addr);
+    writeMap();
+    std::cout << (enable ? "Compressed " : "Decompressed ") << path
+        << " (" << fd.dataBlocks().size() << " => "
+        << converted.dataBlocks().size() << " blocks)" << std::endl;
 
     return true;
 }
 
-bool FileSystem::open(const std::string& path, unsigned int& fd_out) {
+bool FileSystem::clone(const std::string& source, const std::string& destination) {
     if (!m_Device) {
         std::cout << "No device currently mounted" << std::endl;
         return false;
     }
-    const unsigned int freeOsFd = std::distance(m_OpenFiles.begin(),
-            std::find_if(m_OpenFiles.begin(), m_OpenFiles.end(),
-                [](const std::optional<uint16_t>& o){ return !o; }));
-    if (freeOsFd >= m_OpenFiles.size()) {
-        std::cout << "Cannot open file: max limit for OS file descriptors reached. "
-            << "Close some files first" << std::endl;
+    if (!m_DeviceBlockMap.hasRefCounts()) {
+        std::cout << "Device does not keep reference counts, cannot share blocks "
+            << "(format it with the refcounts option)" << std::endl;
         return false;
     }
 
-    const auto dir_fdName = extractPath(path);
-    if (!dir_fdName.first) {
-        std::cout << "Invalid path, cannot create file" << std::endl;
+    const auto source_dirName = extractPath(source);
+    if (!source_dirName.first) {
+        std::cout << "Invalid source path" << std::endl;
         return false;
     }
-    DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
-    const std::string name = dir_fdName.second;
-
-    const auto fileFdOpt = getFdOfFileWithName(dir, name);
-    if (!fileFdOpt) {
-        std::cout << "No file with this name exists" << std::endl;
+    const DeviceFileDescriptor sourceDir = DeviceFileDescriptor::read(*m_Device, *source_dirName.first);
+    const auto sourceIndexOpt = getFdOfFileWithName(sourceDir, source_dirName.second);
+    if (!sourceIndexOpt) {
+        std::cout << "No file with name " << source << " exists" << std::endl;
         return false;
     }
-    if (const auto i = std::find_if(m_OpenFiles.begin(), m_OpenFiles.end(),
-            [fileFd = *fileFdOpt](const std::optional<uint16_t>& o){ return o && *o == fileFd; });
-                i != m_OpenFiles.end()) {
-        std::cout << "This file is already open with os_fd="
-            << std::distance(m_OpenFiles.begin(), i) << std::endl;
+    const DeviceFileDescriptor sourceFd = DeviceFileDescriptor::read(*m_Device, *sourceIndexOpt);
+    if (sourceFd.fileType != DeviceFileType::Regular) {
+        std::cout << "Only regular files can be cloned" << std::endl;
         return false;
     }
-    /* std::cout << "File descriptor of this file is " << *fileFdOpt << std::endl; */
-    m_OpenFiles[freeOsFd] = {*fileFdOpt};
-    fd_out = freeOsFd;
-
-    return true;
-}
 
-bool FileSystem::close(unsigned int fd) {
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
+    const auto destination_dirName = extractPath(destination);
+    if (!destination_dirName.first) {
+        std::cout << "Invalid destination path" << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor destinationDir = DeviceFileDescriptor::read(*m_Device, *destination_dirName.first);
+    if (getFdOfFileWithName(destinationDir, destination_dirName.second)) {
+        std::cout << "File " << destination << " already exists" << std::endl;
+        return false;
+    }
+    const auto freeFdOpt = m_Descriptors.allocate(m_Descriptors.groupOf(*destination_dirName.first));
+    if (!freeFdOpt) {
+        std::cout << "No empty FD left, cannot create a new file" << std::endl;
         return false;
     }
 
-    if (!m_OpenFiles[fd]) {
-        std::cout << "No file with os_fd=" << fd << " currently openned" << std::endl;
+    // Share every block of the source, they get copied on write
+    const std::vector<uint16_t> shared = sourceFd.dataBlocks();
+    for (unsigned int i = 0; i < shared.size(); i++) {
+        if (m_DeviceBlockMap.addRef(shared[i])) continue;
+        for (unsigned int j = 0; j < i; j++) m_DeviceBlockMap.release(shared[j]);
+        m_Descriptors.release(*freeFdOpt);
+        std::cout << "Block " << shared[i] << " is shared too many times, cannot clone" << std::endl;
+        return false;
+    }
+    DeviceFileDescriptor fd = sourceFd;
+    fd.linksCount = 1;
+    DeviceFileDescriptor::write(*m_Device, *freeFdOpt, fd);
+    if (const FsError error = create(*destination_dirName.first, destinationDir,
+                destination_dirName.second, *freeFdOpt, fd.fileType); error != FsError::Ok) {
+        for (uint16_t addr : shared) m_DeviceBlockMap.release(addr);
+        DeviceFileDescriptor::write(*m_Device, *freeFdOpt, {});
+        m_Descriptors.release(*freeFdOpt);
+        std::cout << toString(error) << std::endl;
         return false;
     }
-    m_OpenFiles[fd] = std::nullopt;
-    std::cout << "Closed file with os_fd=" << fd << std::endl;
+    // create() has written the map (and with it the reference counts)
+    std::cout << "Cloned " << source << " into " << destination
+        << " (FD=" << *freeFdOpt << ", " << shared.size() << " shared blocks)" << std::endl;
 
     return true;
 }
 
-bool FileSystem::read(unsigned int fd, unsigned int shift, unsigned int size, std::string& buff) {
+bool FileSystem::createSnapshot(const std::string& name) {
     if (!m_Device) {
         std::cout << "No device currently mounted" << std::endl;
         return false;
     }
-    if (!m_OpenFiles[fd]) {
-        std::cout << "No file with os_fd=" << fd << " currently open" << std::endl;
+    if (name.empty() || name.size() > DeviceSnapshot::MAX_NAME_SIZE) {
+        std::cout << "Snapshot name must have 1 to " << DeviceSnapshot::MAX_NAME_SIZE
+            << " characters" << std::endl;
         return false;
     }
-
-    DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[fd]);
-    assert(dfd.fileType == DeviceFileType::Regular || dfd.fileType == DeviceFileType::Symlink);
-    const unsigned int farEnd = shift + size;
-    if (farEnd > dfd.size) {
-        std::cout << "Requested pointer is beyond the file" << std::endl;
+    const unsigned int maxFiles = m_DeviceHeader.maxFiles;
+    std::optional<unsigned int> freeSlotOpt;
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        const DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, maxFiles);
+        if (snapshot.state == DeviceSnapshot::State::Empty) {
+            if (!freeSlotOpt) freeSlotOpt = slot;
+        } else if (snapshot.name == name) {
+            std::cout << "Snapshot " << name << " already exists" << std::endl;
+            return false;
+        }
+    }
+    if (!freeSlotOpt) {
+        std::cout << "No free snapshot slot left (the device has "
+            << m_DeviceHeader.snapshotSlots << ")" << std::endl;
         return false;
     }
 
-    buff.clear();
-    unsigned int readSize = 0;
-    bool finished = false;
-    for (uint16_t addr : dfd.blocks) {
-        if (addr == Block::INVALID) break;
-        const Block data = m_Device->readBlock(Device::DATA_START + addr);
-        for (unsigned int i = 0; i < Device::BLOCK_SIZE; i++) {
-            if (readSize == farEnd) {
-                finished = true;
-                break;
+    // Only metadata is copied: the descriptor table, plus a reference on
+    // every block it points to
+    const unsigned int fdBlocks = DeviceFileDescriptor::sizeInBlocks();
+    const std::vector<Block> table = m_Device->readBlocks(Device::FDS_START, maxFiles * fdBlocks);
+    std::vector<uint16_t> referenced;
+    for (unsigned int i = 0; i < maxFiles; i++) {
+        const DeviceFileDescriptor fd(std::span<const Block>(table).subspan(i * fdBlocks, fdBlocks));
+        if (fd.fileType == DeviceFileType::Empty) continue;
+        for (uint16_t addr : fd.dataBlocks()) {
+            if (!m_DeviceBlockMap.addRef(addr)) {
+                for (uint16_t taken : referenced) m_DeviceBlockMap.release(taken);
+                std::cout << "Block " << addr << " is shared too many times, "
+                    << "cannot take a snapshot" << std::endl;
+                return false;
             }
-            assert(readSize < dfd.size); // can't happen, checked earlier
-            if (shift <= readSize)
-                buff += data[i];
-            readSize++;
+            referenced.push_back(addr);
         }
-        if (finished) break;
     }
+    m_Device->writeBlocks(DeviceSnapshot::tableStart(*freeSlotOpt, maxFiles), table);
+    writeMap();
+
+    DeviceSnapshot snapshot;
+    snapshot.state = DeviceSnapshot::State::Active;
+    snapshot.name = name;
+    snapshot.write(*m_Device, *freeSlotOpt, maxFiles);
+    std::cout << "Created snapshot " << name << " (" << referenced.size()
+        << " shared blocks)" << std::endl;
 
     return true;
 }
 
-bool FileSystem::write(unsigned int fd, unsigned int shift, const std::string& buff) {
+bool FileSystem::deleteSnapshot(const std::string& name) {
     if (!m_Device) {
         std::cout << "No device currently mounted" << std::endl;
         return false;
     }
-    if (!m_OpenFiles[fd]) {
-        std::cout << "No file with os_fd=" << fd << " currently open" << std::endl;
-        return false;
-    }
-    if (buff.size() == 0) {
-        std::cout << "Write 0 bytes" << std::endl;
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, m_DeviceHeader.maxFiles);
+        if (snapshot.state != DeviceSnapshot::State::Active || snapshot.name != name) continue;
+        snapshot.state = DeviceSnapshot::State::Deleting;
+        snapshot.reclaimed = 0;
+        snapshot.write(*m_Device, slot, m_DeviceHeader.maxFiles);
+        m_Reclaiming = true;
+        std::cout << "Snapshot " << name << " will be reclaimed in the background" << std::endl;
         return true;
     }
 
-    DeviceFileDescriptor dfd = DeviceFileDescriptor::read(*m_Device, *m_OpenFiles[fd]);
-    assert(dfd.fileType == DeviceFileType::Regular);
-    if (shift > dfd.size) {
-        std::cout << "Shift is beyond the end of the file" << std::endl;
+    std::cout << "No snapshot named " << name << std::endl;
+    return false;
+}
+
+bool FileSystem::listSnapshots() {
+    if (!m_Device) {
+        std::cout << "No device currently mounted" << std::endl;
         return false;
     }
-
-    unsigned int ptr = 0;
-    unsigned int buffPtr = 0;
-    bool finished = false;
-    for (unsigned int blockIndex = 0; blockIndex < dfd.blocks.size(); blockIndex++) {
-        unsigned int addr = dfd.blocks[blockIndex];
-        if (addr == DeviceFileDescriptor::FREE_BLOCK) {
-            const auto freeOpt = m_DeviceBlockMap.findFree();
-            if (!freeOpt) {
-                std::cout << "No free data blocks left, cannot write" << std::endl;
-                return false;
-            }
-            dfd.blocks[blockIndex] = *freeOpt;
-            addr = dfd.blocks[blockIndex];
-            m_DeviceBlockMap.setTaken(*freeOpt);
-            m_DeviceBlockMap.write(*m_Device);
-        }
-        if (ptr + Device::BLOCK_SIZE <= shift) {
-            ptr += Device::BLOCK_SIZE;
-            continue;
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        const DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, m_DeviceHeader.maxFiles);
+        if (snapshot.state == DeviceSnapshot::State::Empty) continue;
+        std::cout << "-- " << snapshot.name;
+        if (snapshot.state == DeviceSnapshot::State::Deleting) {
+            std::cout << " (deleting, " << snapshot.reclaimed << "/"
+                << m_DeviceHeader.maxFiles << " FDs released)";
         }
-        Block data = m_Device->readBlock(Device::DATA_START + addr);
-        for (unsigned int i = 0; i < Device::BLOCK_SIZE; i++) {
-            if (ptr++ < shift) continue;
-            data[ptr - 1] = buff[buffPtr++]; // ptr was inced at the prev line
-            if (ptr == shift + buff.size()) {
-                finished = true;
-                break;
-            }
-        }
-        m_Device->writeBlock(Device::DATA_START + addr, data);
-        if (finished) break;
+        std::cout << std::endl;
     }
 
-    std::cout << "Wrote " << buff.size() << " bytes" << std::endl;
-    dfd.size += (shift + buff.size() > dfd.size) ? (shift + buff.size() - dfd.size) : 0;
-    DeviceFileDescriptor::write(*m_Device, *m_OpenFiles[fd], dfd);
-
     return true;
 }
 
-bool FileSystem::link(const std::string& name1, const std::string& name2) {
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
-        return false;
-    }
+void FileSystem::reclaimSnapshots(unsigned int maxDescriptors) {
+    const unsigned int maxFiles = m_DeviceHeader.maxFiles;
+    bool pending = false;
+    for (unsigned int slot = 0; slot < m_DeviceHeader.snapshotSlots; slot++) {
+        DeviceSnapshot snapshot = DeviceSnapshot::read(*m_Device, slot, maxFiles);
+        if (snapshot.state != DeviceSnapshot::State::Deleting) continue;
+        if (maxDescriptors == 0) {
+            pending = true;
+            break;
+        }
 
-    const auto dir_fdName = extractPath(name1);
-    if (!dir_fdName.first) {
-        std::cout << "Invalid path, cannot create file" << std::endl;
-        return false;
+        const unsigned int from = snapshot.reclaimed;
+        const unsigned int to = std::min(maxFiles, from + maxDescriptors);
+        maxDescriptors -= to - from;
+        snapshot.reclaimed = to;
+        if (to == maxFiles) snapshot = {};
+        else pending = true;
+        // Progress first: a crash in between leaks references instead of
+        // releasing them twice
+        snapshot.write(*m_Device, slot, maxFiles);
+
+        const unsigned int tableStart = DeviceSnapshot::tableStart(slot, maxFiles);
+        for (unsigned int i = from; i < to; i++) {
+            const DeviceFileDescriptor fd = DeviceFileDescriptor::read(*m_Device, i, tableStart);
+            if (fd.fileType == DeviceFileType::Empty) continue;
+            for (uint16_t addr : fd.dataBlocks()) releaseBlock(addr);
+        }
+        writeMap();
     }
+    m_Reclaiming = pending;
+}
+
+FsError FileSystem::link(std::string_view target, std::string_view name) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
+
+    const auto dir_fdName = extractPath(std::string(target));
+    if (!dir_fdName.first) return FsError::InvalidPath;
     DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
     const std::string fileName = dir_fdName.second;
 
     const auto fdIndexOpt = getFdOfFileWithName(dir, fileName);
-    if (!fdIndexOpt) {
-        std::cout << "No file with name " << name1
-            << " exists, cannot create hard link" << std::endl;
-        return false;
-    }
+    if (!fdIndexOpt) return FsError::NotFound;
     auto fd = DeviceFileDescriptor::read(*m_Device, *fdIndexOpt);
     fd.linksCount++;
     DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
 
-    const bool result = create(*dir_fdName.first, dir, name2, *fdIndexOpt);
-    if (!result) return false;
-    std::cout << "Creaing a hard link: " << name2 << "=>" << fileName << std::endl;
+    if (const FsError error = create(*dir_fdName.first, dir, std::string(name), *fdIndexOpt, fd.fileType);
+            error != FsError::Ok) {
+        fd.linksCount--;
+        DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
+        return error;
+    }
 
-    return true;
+    return FsError::Ok;
 }
 
-bool FileSystem::unlink(const std::string& name) {
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
-        return false;
-    }
+FsError FileSystem::unlink(std::string_view name) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
 
-    const auto dir_fdName = extractPath(name);
-    if (!dir_fdName.first) {
-        std::cout << "Invalid path, cannot create file" << std::endl;
-        return false;
-    }
+    const auto dir_fdName = extractPath(std::string(name));
+    if (!dir_fdName.first) return FsError::InvalidPath;
     DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
     const std::string fileName = dir_fdName.second;
 
     const auto fdIndexOpt = getFdOfFileWithName(dir, fileName);
-    if (!fdIndexOpt) {
-        std::cout << "No file with name " << name
-            << " exists, cannot unlink hard link" << std::endl;
-        return false;
-    }
+    if (!fdIndexOpt) return FsError::NotFound;
 
     // Remove link file (dir etry) from dir
     for (unsigned int i = 0; i < dir.blocks.size(); i += 2) {
-        if (dir.blocks[i + 1] == *fdIndexOpt) {
+        if (DeviceFileDescriptor::entryFd(dir.blocks[i + 1]) == *fdIndexOpt) {
             const uint16_t fileNameBlockAddr = dir.blocks[i];
-            const std::string fileName =
+            const std::string entryName =
                 m_Device->readBlock(Device::DATA_START + fileNameBlockAddr).asString();
-            if (fileName != name) {
+            if (entryName != fileName) {
                 // Found another hard link for this FD => keep looking
                 continue;
             }
-            m_DeviceBlockMap.setFree(fileNameBlockAddr);
-            m_DeviceBlockMap.write(*m_Device);
+            releaseBlock(fileNameBlockAddr);
+            writeMap();
 
             dir.blocks[i] = DeviceFileDescriptor::FREE_BLOCK;
             dir.blocks[i + 1] = DeviceFileDescriptor::FREE_BLOCK;
@@ -545,97 +2087,77 @@ bool FileSystem::unlink(const std::string& name) {
         }
     }
 
-    std::cout << "Successfully unlinked hard" << std::endl;
-
     auto fd = DeviceFileDescriptor::read(*m_Device, *fdIndexOpt);
     fd.linksCount--;
     if (fd.linksCount == 0) {
         // Need to remove FD as well
         remove(fd, *fdIndexOpt);
-        std::cout << "Hard links count reached 0 => removed the FD as well" << std::endl;
+    } else {
+        DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
     }
-    DeviceFileDescriptor::write(*m_Device, *fdIndexOpt, fd);
-
 
-    return true;
+    return FsError::Ok;
 }
 
-bool FileSystem::mkdir(const std::string& name) {
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
-        return false;
-    }
+FsError FileSystem::mkdir(std::string_view name) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
 
-    const auto dir_fdName = extractPath(name);
-    if (!dir_fdName.first) {
-        std::cout << "Invalid path, cannot create file" << std::endl;
-        return false;
-    }
+    const auto dir_fdName = extractPath(std::string(name));
+    if (!dir_fdName.first) return FsError::InvalidPath;
     DeviceFileDescriptor parent = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
     const std::string fileName = dir_fdName.second;
 
-    // Find FD for future file
-    const auto freeFdOpt = DeviceFileDescriptor::findFree(*m_Device);
-    if (!freeFdOpt) {
-        std::cout << "No empty FD left, cannot create a new directory here" << std::endl;
-        return false;
-    }
+    // Directories go to the group with the most room left
+    const auto freeFdOpt = m_Descriptors.allocate(m_Descriptors.emptiestGroup());
+    if (!freeFdOpt) return FsError::NoFreeDescriptor;
+
+    return makeDirectory(*dir_fdName.first, parent, extractName(std::string(name)), *freeFdOpt);
+}
 
-    // Create file inside found FD
-    const std::string dirName = extractName(name);
+FsError FileSystem::makeDirectory(uint16_t parentIndex, DeviceFileDescriptor& parent,
+        const std::string& name, uint16_t fdIndex) {
     DeviceFileDescriptor fd(DeviceFileType::Directory, 2, 2,
             std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK));
-
     // Parent link
-    const auto link1FileNameAddrOpt = m_DeviceBlockMap.findFree();
-    assert(link1FileNameAddrOpt); // TODO: handle no mem left
-    m_DeviceBlockMap.setTaken(*link1FileNameAddrOpt);
-    m_DeviceBlockMap.write(*m_Device);
+    const auto link1FileNameAddrOpt = m_DeviceBlockMap.allocate(m_Descriptors.groupOf(fdIndex));
+    if (!link1FileNameAddrOpt) {
+        remove(fd, fdIndex);
+        return FsError::NoSpace;
+    }
+    writeMap();
     m_Device->writeBlock(Device::DATA_START + *link1FileNameAddrOpt, {".."});
     fd.blocks[0] = *link1FileNameAddrOpt;
-    fd.blocks[1] = *dir_fdName.first;
+    fd.blocks[1] = DeviceFileDescriptor::toEntry(parentIndex, DeviceFileType::Directory);
 
     // Self link
-    const auto link2FileNameAddrOpt = m_DeviceBlockMap.findFree();
-    assert(link2FileNameAddrOpt); // TODO: handle no mem left
-    m_DeviceBlockMap.setTaken(*link2FileNameAddrOpt);
-    m_DeviceBlockMap.write(*m_Device);
+    const auto link2FileNameAddrOpt = m_DeviceBlockMap.allocate(m_Descriptors.groupOf(fdIndex));
+    if (!link2FileNameAddrOpt) {
+        remove(fd, fdIndex); // with the parent link taken so far
+        return FsError::NoSpace;
+    }
+    writeMap();
     m_Device->writeBlock(Device::DATA_START + *link2FileNameAddrOpt, {"."});
     fd.blocks[2] = *link2FileNameAddrOpt;
-    fd.blocks[3] = *freeFdOpt;
-
-    DeviceFileDescriptor::write(*m_Device, *freeFdOpt, fd);
+    fd.blocks[3] = DeviceFileDescriptor::toEntry(fdIndex, DeviceFileType::Directory);
 
-    const bool result = create(*dir_fdName.first, parent, dirName, *freeFdOpt);
-    if (!result) return false;
-    std::cout << "Created new directory with FD=" << *freeFdOpt << std::endl;
+    DeviceFileDescriptor::write(*m_Device, fdIndex, fd);
 
-    return true;
+    const FsError error = create(parentIndex, parent, name, fdIndex, DeviceFileType::Directory);
+    if (error != FsError::Ok) remove(fd, fdIndex);
+    return error;
 }
 
-bool FileSystem::rmdir(const std::string& name) {
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
-        return false;
-    }
+FsError FileSystem::rmdir(std::string_view name) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
 
-    const auto dir_fdName = extractPath(name);
-    if (!dir_fdName.first) {
-        std::cout << "Invalid path" << std::endl;
-        return false;
-    }
+    const auto dir_fdName = extractPath(std::string(name));
+    if (!dir_fdName.first) return FsError::InvalidPath;
     DeviceFileDescriptor parent = DeviceFileDescriptor::read(*m_Device, *dir_fdName.first);
     const std::string fileName = dir_fdName.second;
     auto dirIndexOpt = getFdOfFileWithName(parent, dir_fdName.second);
-    if (!dirIndexOpt) {
-        std::cout << "No directory with specified name exists" << std::endl;
-        return false;
-    }
+    if (!dirIndexOpt) return FsError::NotFound;
     DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, *dirIndexOpt);
-    if (dir.size > 2) { // more than two mandatory links
-        std::cout << "Directory must be empty in order to be able to remove it" << std::endl;
-        return false;
-    }
+    if (dir.size > 2) return FsError::NotEmpty; // more than two mandatory links
 
     // Remove from parent
     for (unsigned int i = 0; i < Device::FD_BLOCKS_PER_FILE; i += 2) {
@@ -645,8 +2167,8 @@ bool FileSystem::rmdir(const std::string& name) {
             m_Device->readBlock(Device::DATA_START + addr).asString();
         if (childName == dir_fdName.second) {
             // Free mem for child name
-            m_DeviceBlockMap.setFree(addr);
-            m_DeviceBlockMap.write(*m_Device);
+            releaseBlock(addr);
+            writeMap();
 
             parent.blocks[i] = DeviceFileDescriptor::FREE_BLOCK;
             parent.blocks[i + 1] = DeviceFileDescriptor::FREE_BLOCK;
@@ -659,9 +2181,7 @@ bool FileSystem::rmdir(const std::string& name) {
     // Clear dir contents (release memory for links)
     remove(dir, *dirIndexOpt);
 
-    std::cout << "Successfully removed dir " << dir_fdName.second << std::endl;
-
-    return true;
+    return FsError::Ok;
 }
 
 bool FileSystem::cd(std::string path) {
@@ -689,43 +2209,71 @@ bool FileSystem::cd(std::string path) {
     return true;
 }
 
-bool FileSystem::symlink(std::string target, const std::string& linkName) {
-    const std::string targetCopy = target;
-    if (!m_Device) {
-        std::cout << "No device currently mounted" << std::endl;
-        return false;
-    }
+FsError FileSystem::symlink(std::string_view target, std::string_view linkName) {
+    if (const FsError error = usable(true); error != FsError::Ok) return error;
 
     // Always inside working dir
     DeviceFileDescriptor dir = DeviceFileDescriptor::read(*m_Device, m_WorkingDirectory);
 
     // Find FD for future file
-    const auto freeFdOpt = DeviceFileDescriptor::findFree(*m_Device);
-    if (!freeFdOpt) {
-        std::cout << "No empty FD left, cannot create a new file" << std::endl;
-        return false;
-    }
+    const auto freeFdOpt = m_Descriptors.allocate(m_Descriptors.groupOf(m_WorkingDirectory));
+    if (!freeFdOpt) return FsError::NoFreeDescriptor;
 
-    // Create file inside found FD
+    return makeSymlink(m_WorkingDirectory, dir, std::string(linkName), target, *freeFdOpt);
+}
+
+FsError FileSystem::makeSymlink(uint16_t dirIndex, DeviceFileDescriptor& dir,
+        const std::string& name, std::string_view target, uint16_t fdIndex) {
+    if (target.size() > Device::FD_BLOCKS_PER_FILE * Device::BLOCK_SIZE) {
+        m_Descriptors.release(fdIndex);
+        return FsError::FileTooLarge;
+    }
     DeviceFileDescriptor fd(DeviceFileType::Symlink, target.size(), 1,
             std::vector<uint16_t>(Device::FD_BLOCKS_PER_FILE, DeviceFileDescriptor::FREE_BLOCK));
     unsigned int counter = 0;
     while (target.size() > 0) {
         const bool toEnd = target.size() <= Device::BLOCK_SIZE;
-        const Block data{target.substr(0, toEnd ? target.size() : Device::BLOCK_SIZE)};
-        auto freeIndexOpt = m_DeviceBlockMap.findFree();
-        assert(freeIndexOpt); // TODO
+        const Block data{std::string(target.substr(0, toEnd ? target.size() : Device::BLOCK_SIZE))};
+        auto freeIndexOpt = m_DeviceBlockMap.allocate(m_Descriptors.groupOf(fdIndex));
+        if (!freeIndexOpt) {
+            remove(fd, fdIndex); // with the blocks taken so far
+            return FsError::NoSpace;
+        }
         m_Device->writeBlock(Device::DATA_START + *freeIndexOpt, data);
-        m_DeviceBlockMap.setTaken(*freeIndexOpt);
-        m_DeviceBlockMap.write(*m_Device);
+        writeMap();
         fd.blocks[counter++] = *freeIndexOpt;
-        target.erase(0, Device::BLOCK_SIZE);
+        target.remove_prefix(toEnd ? target.size() : Device::BLOCK_SIZE);
     }
-    DeviceFileDescriptor::write(*m_Device, *freeFdOpt, fd);
+    DeviceFileDescriptor::write(*m_Device, fdIndex, fd);
+
+    const FsError error = create(dirIndex, dir, name, fdIndex, DeviceFileType::Symlink);
+    if (error != FsError::Ok) remove(fd, fdIndex);
+    return error;
+}
+
+bool FileSystem::startTrace(const std::string& traceName) {
+    if (m_Trace) {
+        std::cout << "A trace is already being recorded. Stop it first" << std::endl;
+        return false;
+    }
+    m_Trace = std::make_unique<TraceWriter>(traceName);
+    if (!m_Trace->is_open()) {
+        std::cout << "Could not open trace file " << traceName << std::endl;
+        m_Trace.reset();
+        return false;
+    }
+    std::cout << "Recording trace into " << traceName << std::endl;
 
-    const bool result = create(m_WorkingDirectory, dir, linkName, *freeFdOpt);
-    if (!result) return false;
-    std::cout << "Created new symlink " << linkName << " => " << targetCopy << std::endl;
+    return true;
+}
+
+bool FileSystem::stopTrace() {
+    if (!m_Trace) {
+        std::cout << "No trace is being recorded" << std::endl;
+        return false;
+    }
+    m_Trace.reset();
+    std::cout << "Stopped recording trace" << std::endl;
 
     return true;
 }
@@ -755,12 +2303,83 @@ std::string toString(Command command) {
         case Command::Cd: return "cd";
         case Command::Pwd: return "pwd";
         case Command::Symlink: return "symlink";
+        case Command::Trace: return "trace";
+        case Command::Mkfs: return "mkfs";
+        case Command::Compress: return "compress";
+        case Command::Clone: return "clone";
+        case Command::Snapshot: return "snapshot";
+        case Command::Seek: return "seek";
+        case Command::Fallocate: return "fallocate";
+        case Command::Sync: return "sync";
+        case Command::Map: return "map";
+        case Command::Du: return "du";
+        case Command::Import: return "import";
+        case Command::Export: return "export";
+        case Command::Defrag: return "defrag";
+        case Command::Begin: return "begin";
+        case Command::Commit: return "commit";
+        case Command::Statfs: return "statfs";
         case Command::INVALID: return "<invalid>";
     }
     return "<undefined>";
 }
 
 
+std::string toString(FsError error) {
+    switch (error) {
+        case FsError::Ok: return "Success";
+        case FsError::NotMounted: return "No device currently mounted";
+        case FsError::ReadOnly: return "Device is mounted read-only";
+        case FsError::InvalidPath: return "Invalid path";
+        case FsError::NotFound: return "No file with this name exists";
+        case FsError::BadFd: return "No file with this os_fd currently open";
+        case FsError::TooManyOpenFiles:
+            return "Max limit for OS file descriptors reached, close some files first";
+        case FsError::AlreadyOpen: return "This file is already open";
+        case FsError::NoFreeDescriptor: return "No empty FD left";
+        case FsError::NoSpace: return "No free data blocks left";
+        case FsError::DirectoryFull: return "Maximum number of files for this dir reached";
+        case FsError::NotEmpty: return "Directory must be empty in order to be able to remove it";
+        case FsError::OutOfRange: return "Requested pointer is beyond the file";
+        case FsError::FileTooLarge: return "File is too large for its descriptor";
+        case FsError::Corrupted: return "Compressed data is corrupted";
+        case FsError::NotADirectory: return "Not a directory";
+    }
+    return "<undefined>";
+}
+
+// Prints what a typed call did for the CLI
+static bool report(FsError error, const std::string& done) {
+    std::cout << (error == FsError::Ok ? done : toString(error)) << std::endl;
+    return error == FsError::Ok;
+}
+
+
+bool isModifying(Command command, const std::vector<std::string>& arguments) {
+    switch (command) {
+        case Command::Create:
+        case Command::Write:
+        case Command::Link:
+        case Command::Unlink:
+        case Command::Truncate:
+        case Command::Mkdir:
+        case Command::Rmdir:
+        case Command::Symlink:
+        case Command::Compress:
+        case Command::Clone:
+        case Command::Fallocate:
+        case Command::Import:
+        case Command::Defrag:
+        case Command::Begin:
+        case Command::Commit:
+            return true;
+        case Command::Snapshot:
+            return arguments.empty() || arguments[0] != "list";
+        default:
+            return false;
+    }
+}
+
 Command toCommand(const std::string& str) {
     if (str == "mount") return Command::Mount;
     else if (str == "umount") return Command::Umount;
@@ -779,24 +2398,58 @@ Command toCommand(const std::string& str) {
     else if (str == "cd") return Command::Cd;
     else if (str == "pwd") return Command::Pwd;
     else if (str == "symlink") return Command::Symlink;
+    else if (str == "trace") return Command::Trace;
+    else if (str == "mkfs") return Command::Mkfs;
+    else if (str == "compress") return Command::Compress;
+    else if (str == "clone") return Command::Clone;
+    else if (str == "snapshot") return Command::Snapshot;
+    else if (str == "seek") return Command::Seek;
+    else if (str == "fallocate") return Command::Fallocate;
+    else if (str == "sync") return Command::Sync;
+    else if (str == "map") return Command::Map;
+    else if (str == "du") return Command::Du;
+    else if (str == "import") return Command::Import;
+    else if (str == "export") return Command::Export;
+    else if (str == "defrag") return Command::Defrag;
+    else if (str == "begin") return Command::Begin;
+    else if (str == "commit") return Command::Commit;
+    else if (str == "statfs") return Command::Statfs;
 
     return Command::INVALID;
 }
 
 bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
+    std::unique_lock<std::shared_mutex> lock(m_Mutex);
+    if (m_Trace && command != Command::Trace) {
+        m_Trace->record(static_cast<uint8_t>(command), arguments);
+    }
+    if (m_ReadOnly && isModifying(command, arguments)) {
+        std::cout << "Device is mounted read-only" << std::endl;
+        return false;
+    }
+    // Deleted snapshots are reclaimed a bit at a time, between commands
+    if (m_Device && m_Reclaiming && !m_ReadOnly) reclaimSnapshots(RECLAIM_STEP);
+
     switch (command) {
         case Command::Mount:
-            if (arguments.size() != 1) {
-                std::cout << "Expecting 1 argument: device name" << std::endl;
+            if (arguments.size() < 1) {
+                std::cout << "Expecting arguments: device name [ram] [compress] [writeback] "
+                    << "[snapshot=<name>]" << std::endl;
                 return false;
             }
-            return mount(arguments[0]);
+            return mount(arguments[0], {arguments.begin() + 1, arguments.end()});
         case Command::Umount:
             if (arguments.size() != 0) {
                 std::cout << "Expecting no arguments" << std::endl;
                 return false;
             }
             return umount();
+        case Command::Sync:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return report(sync(), "Synced device " + m_DeviceName);
         case Command::Filestat:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: descriptor id" << std::endl;
@@ -805,7 +2458,7 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
             try {
                 const unsigned int fd = std::stoi(arguments[0]);
                 return filestat(fd);
-            } catch (std::exception& e) {
+            } catch (std::logic_error& e) {
                 std::cout << "Expection an int argument" << std::endl;
                 return false;
             }
@@ -815,24 +2468,69 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 return false;
             }
             return ls();
+        case Command::Map:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return map();
+        case Command::Du:
+            if (arguments.size() > 2) {
+                std::cout << "Expecting arguments: [directory] [name pattern]" << std::endl;
+                return false;
+            }
+            return du(arguments.size() > 0 ? arguments[0] : "", arguments.size() > 1 ? arguments[1] : "");
+        case Command::Import:
+            if (arguments.size() != 2) {
+                std::cout << "Expecting 2 arguments: host directory, directory" << std::endl;
+                return false;
+            }
+            return importTree(arguments[0], arguments[1]);
+        case Command::Export:
+            if (arguments.size() != 2) {
+                std::cout << "Expecting 2 arguments: directory, host directory" << std::endl;
+                return false;
+            }
+            return exportTree(arguments[0], arguments[1]);
+        case Command::Defrag:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return defrag();
+        case Command::Begin:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return begin();
+        case Command::Commit:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return commit();
+        case Command::Statfs:
+            if (arguments.size() != 0) {
+                std::cout << "Expecting no arguments" << std::endl;
+                return false;
+            }
+            return statfs();
         case Command::Create:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: file name" << std::endl;
                 return false;
             }
-            return create(arguments[0]);
+            return report(create(arguments[0]), "Created new file " + arguments[0]);
         case Command::Open:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: file name" << std::endl;
                 return false;
             }
             {
-                unsigned int fd;
-                const bool result = open(arguments[0], fd);
-                if (result)
-                    std::cout << "Opened file " << arguments[0]
-                        << " with os_fd=" << fd << std::endl;
-                return result;
+                unsigned int fd = 0;
+                const FsError error = open(arguments[0], fd);
+                return report(error, "Opened file " + arguments[0] + " with os_fd=" + std::to_string(fd));
             }
         case Command::Close:
             if (arguments.size() != 1) {
@@ -840,8 +2538,9 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 return false;
             }
             try {
-                return close(std::stoi(arguments[0]));
-            } catch (std::exception& e) {
+                const unsigned int fd = std::stoi(arguments[0]);
+                return report(close(fd), "Closed file with os_fd=" + std::to_string(fd));
+            } catch (std::logic_error& e) {
                 std::cout << "Excepting an int argument" << std::endl;
                 return false;
             }
@@ -854,12 +2553,12 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 const unsigned int fd = std::stoi(arguments[0]);
                 const unsigned int shift = std::stoi(arguments[1]);
                 const unsigned int size = std::stoi(arguments[2]);
-                std::string buff;
-                const bool result = read(fd, shift, size, buff);
-                if (result)
-                    std::cout << "Data:\"" << buff << "\"";
-                return result;
-            } catch (std::exception& e) {
+                std::string buff(size, '\0');
+                const FsError error = read(fd, shift, buff);
+                if (error != FsError::Ok) return report(error, "");
+                std::cout << "Data:\"" << buff << "\"";
+                return true;
+            } catch (std::logic_error& e) {
                 std::cout << "Expecting an int argument" << std::endl;
                 return false;
             }
@@ -871,8 +2570,9 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
             try {
                 const unsigned int fd = std::stoi(arguments[0]);
                 const unsigned int shift = std::stoi(arguments[1]);
-                return write(fd, shift, arguments[2]);
-            } catch (std::exception& e) {
+                return report(write(fd, shift, arguments[2]),
+                        "Wrote " + std::to_string(arguments[2].size()) + " bytes");
+            } catch (std::logic_error& e) {
                 std::cout << "Expecting an int argument" << std::endl;
                 return false;
             }
@@ -881,13 +2581,14 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 std::cout << "Expecting 2 arguments: target name, link name" << std::endl;
                 return false;
             }
-            return link(arguments[0], arguments[1]);
+            return report(link(arguments[0], arguments[1]),
+                    "Created hard link " + arguments[1] + " => " + arguments[0]);
         case Command::Unlink:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: link name" << std::endl;
                 return false;
             }
-            return unlink(arguments[0]);
+            return report(unlink(arguments[0]), "Unlinked " + arguments[0]);
         case Command::Truncate:
             std::cout << "Operation not supported for now" << std::endl;
             return true;
@@ -898,7 +2599,7 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
             /* try { */
             /*     const unsigned int size = std::stoi(arguments[1]); */
             /*     return truncate(arguments[0], size); */
-            /* } catch (std::exception& e) { */
+            /* } catch (std::logic_error& e) { */
             /*     std::cout << "Expecting an int argument" << std::endl; */
             /*     return false; */
             /* } */
@@ -907,13 +2608,13 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 std::cout << "Expecting 1 argument: directory name" << std::endl;
                 return false;
             }
-            return mkdir(arguments[0]);
+            return report(mkdir(arguments[0]), "Created new directory " + arguments[0]);
         case Command::Rmdir:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: directory name" << std::endl;
                 return false;
             }
-            return rmdir(arguments[0]);
+            return report(rmdir(arguments[0]), "Removed directory " + arguments[0]);
         case Command::Cd:
             if (arguments.size() != 1) {
                 std::cout << "Expecting 1 argument: directory name" << std::endl;
@@ -931,7 +2632,73 @@ bool FileSystem::process(Command command, std::vector<std::string>& arguments) {
                 std::cout << "Expecting 2 arguments: target path, link name" << std::endl;
                 return false;
             }
-            return symlink(arguments[0], arguments[1]);
+            return report(symlink(arguments[0], arguments[1]),
+                    "Created new symlink " + arguments[1] + " => " + arguments[0]);
+        case Command::Trace:
+            if (arguments.size() == 2 && arguments[0] == "start") {
+                return startTrace(arguments[1]);
+            } else if (arguments.size() == 1 && arguments[0] == "stop") {
+                return stopTrace();
+            }
+            std::cout << "Expecting arguments: start <trace file> | stop" << std::endl;
+            return false;
+        case Command::Mkfs:
+            if (arguments.size() < 1) {
+                std::cout << "Expecting arguments: device name [checksums] [refcounts] [dedup] "
+                    << "[snapshots]" << std::endl;
+                return false;
+            }
+            return mkfs(arguments[0], {arguments.begin() + 1, arguments.end()});
+        case Command::Compress:
+            if (arguments.size() != 2 || (arguments[1] != "on" && arguments[1] != "off")) {
+                std::cout << "Expecting 2 arguments: file name, on|off" << std::endl;
+                return false;
+            }
+            return compress(arguments[0], arguments[1] == "on");
+        case Command::Clone:
+            if (arguments.size() != 2) {
+                std::cout << "Expecting 2 arguments: source file name, new file name" << std::endl;
+                return false;
+            }
+            return clone(arguments[0], arguments[1]);
+        case Command::Snapshot:
+            if (arguments.size() == 2 && arguments[0] == "create") {
+                return createSnapshot(arguments[1]);
+            } else if (arguments.size() == 2 && arguments[0] == "delete") {
+                return deleteSnapshot(arguments[1]);
+            } else if (arguments.size() == 1 && arguments[0] == "list") {
+                return listSnapshots();
+            }
+            std::cout << "Expecting arguments: create <name> | delete <name> | list" << std::endl;
+            return false;
+        case Command::Seek:
+            if (arguments.size() != 3 || (arguments[1] != "data" && arguments[1] != "hole")) {
+                std::cout << "Expecting 3 arguments: os_fd, data|hole, offset" << std::endl;
+                return false;
+            }
+            try {
+                const unsigned int fd = std::stoi(arguments[0]);
+                const unsigned int offset = std::stoi(arguments[2]);
+                if (fd >= MAX_OPEN_FILES) {
+                    std::cout << "Invalid os_fd" << std::endl;
+                    return false;
+                }
+                return seek(fd, arguments[1], offset);
+            } catch (std::logic_error& e) {
+                std::cout << "Expecting int arguments" << std::endl;
+                return false;
+            }
+        case Command::Fallocate:
+            if (arguments.size() != 2) {
+                std::cout << "Expecting 2 arguments: file name, size" << std::endl;
+                return false;
+            }
+            try {
+                return fallocate(arguments[0], std::stoi(arguments[1]));
+            } catch (std::logic_error& e) {
+                std::cout << "Expecting an int size" << std::endl;
+                return false;
+            }
         default:
             return false;
     }
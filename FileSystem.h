@@ -12,9 +12,27 @@
 #include <bitset>
 #include <algorithm>
 #include <utility>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <future>
+#include <shared_mutex>
+#include <string_view>
+#include <span>
+#include <filesystem>
+#include <numeric>
+#include <cstring>
 
 #include "Device.h"
+#include "RamDevice.h"
+#include "ChecksumDevice.h"
+#include "WriteBackDevice.h"
+#include "BatchDevice.h"
 #include "Block.h"
+#include "Trace.h"
+#include "Lz.h"
+#include "Dedup.h"
+#include "ThreadPool.h"
 
 
 enum class Command {
@@ -35,11 +53,106 @@ enum class Command {
     Cd,
     Pwd,
     Symlink,
+    Trace,
+    Mkfs,
+    Compress,
+    Clone,
+    Snapshot,
+    Seek,
+    Fallocate,
+    Sync,
+    Map,
+    Du,
+    Import,
+    Export,
+    Defrag,
+    Begin,
+    Commit,
+    Statfs,
     INVALID
 };
 
 std::string toString(Command command);
 Command toCommand(const std::string& str);
+// Whether the command changes the contents of the mounted device
+bool isModifying(Command command, const std::vector<std::string>& arguments);
+
+
+// Outcome of the typed API calls
+enum class FsError {
+    Ok,
+    NotMounted,
+    ReadOnly,
+    InvalidPath,
+    NotFound,
+    BadFd,
+    TooManyOpenFiles,
+    AlreadyOpen,
+    NoFreeDescriptor,
+    NoSpace,
+    DirectoryFull,
+    NotEmpty,
+    OutOfRange,
+    FileTooLarge,
+    Corrupted,
+    NotADirectory
+};
+
+std::string toString(FsError error);
+
+template<typename T>
+struct FsResult {
+    FsError error;
+    T value; // meaningful only if error is Ok
+};
+
+// Pieces of one open file for readv/writev, in any order
+struct ReadSegment {
+    unsigned int shift;
+    std::span<char> buffer; // filled entirely
+};
+
+struct WriteSegment {
+    unsigned int shift;
+    std::string_view data;
+};
+
+struct DirEntry {
+    std::string name;
+    uint16_t fdIndex;
+    DeviceFileType type;
+};
+
+// Position in a directory listing, see FileSystem::readdir. It works on
+// the directory as it was when opened
+class DirCursor {
+    private:
+        friend class FileSystem;
+
+        DeviceFileDescriptor m_Dir;
+        unsigned int m_Slot; // next name pointer to look at
+
+        // Name pointer slots of up to count entries, from slot on
+        std::vector<unsigned int> slotsFrom(unsigned int slot, unsigned int count) const;
+
+    public:
+        DirCursor();
+};
+
+struct FileStat {
+    DeviceFileType type;
+    unsigned int size;
+    unsigned int linksCount;
+    unsigned int blocks; // data blocks it references
+};
+
+struct FsStat {
+    unsigned int blockSize;
+    unsigned int blocks; // data blocks
+    unsigned int freeBlocks;
+    unsigned int descriptors;
+    unsigned int freeDescriptors;
+};
 
 
 class FileSystem {
@@ -49,16 +162,119 @@ class FileSystem {
         DeviceHeader m_DeviceHeader;
 
         DeviceBlockMap m_DeviceBlockMap;
+        // Free descriptors, in the allocation groups of the map: new files
+        // go to the group of their directory, their blocks to the group of
+        // their descriptor, new directories to the emptiest group
+        DeviceDescriptorMap m_Descriptors;
+        std::unique_ptr<DedupIndex> m_DedupIndex; // if the device deduplicates
 
         inline constexpr static unsigned int MAX_OPEN_FILES = 4;
         std::array<std::optional<uint16_t>, MAX_OPEN_FILES> m_OpenFiles;
 
         uint16_t m_WorkingDirectory; // descriptor index
 
+        std::unique_ptr<TraceWriter> m_Trace;
+
+        bool m_CompressNewFiles; // mount option
+        bool m_ReadOnly; // a snapshot is mounted
+        bool m_Reclaiming; // some snapshot is being deleted
+
+        // Between begin and commit: m_Device holding back metadata writes
+        BatchDevice* m_Batch;
+        bool m_MapDirty; // the map is written on commit
+
+        // Snapshot slots of devices formatted with the snapshots option
+        inline constexpr static unsigned int SNAPSHOT_SLOTS = 4;
+        // Descriptors of deleted snapshots released per processed command
+        inline constexpr static unsigned int RECLAIM_STEP = 16;
+        // Entries listed per directory read by ls
+        inline constexpr static unsigned int LS_BATCH = 16;
+        // Threads walking the tree for du
+        inline constexpr static unsigned int DU_THREADS = 4;
+        // Entries in flight between the host and the image for import/export
+        inline constexpr static unsigned int TRANSFER_QUEUE = 64;
+        // Bytes read from (or written to) host files at once
+        inline constexpr static unsigned int TRANSFER_CHUNK = 64 * 1024;
+
+        // Reads of open files share it, everything else holds it exclusively
+        mutable std::shared_mutex m_Mutex;
+        inline constexpr static unsigned int ASYNC_WORKERS = 4;
+        // Declared last, so that queued requests finish before the rest goes
+        std::unique_ptr<ThreadPool> m_Pool;
+
     public:
+        // Files with data blocks and the extents (runs of consecutive
+        // blocks) they are in, free blocks and the extents they form
+        struct Fragmentation {
+            unsigned int files;
+            unsigned int fragmented; // in more than one extent
+            unsigned int extents;
+            unsigned int blocks;
+            unsigned int freeBlocks;
+            unsigned int freeExtents;
+            unsigned int largestFree;
+        };
+
         bool process(Command command, std::vector<std::string>& arguments);
 
+        // Records every subsequent processed command into a binary trace
+        bool startTrace(const std::string& traceName);
+        bool stopTrace();
+
         void createEmptyDevice(const std::string& name);
+        // Options: "checksums", "refcounts", "dedup", "snapshots"
+        bool mkfs(const std::string& name, const std::vector<std::string>& options);
+
+        // Mounts an already opened device (e.g. a RamDevice), optionally one
+        // of its snapshots read-only
+        bool mount(std::unique_ptr<Device> device, const std::string& deviceName,
+                const std::optional<std::string>& snapshotName = std::nullopt);
+
+        // Typed API, for embedding: nothing is parsed or printed. Calls are
+        // not synchronized, like process() they must not overlap (the async
+        // counterparts below may be used from several threads). Paths are
+        // relative to the working directory, names longer than 8 characters
+        // are trimmed. Blocks failing their checksum throw ChecksumError
+        FsError open(std::string_view path, unsigned int& osFd);
+        FsError close(unsigned int osFd);
+        // Fills the whole buffer with the bytes from shift on
+        FsError read(unsigned int osFd, unsigned int shift, std::span<char> buffer);
+        FsError write(unsigned int osFd, unsigned int shift, std::string_view data);
+        // Several ranges with one descriptor lookup; the blocks behind them
+        // are read (or written) once, as a batch sorted by address
+        FsError readv(unsigned int osFd, std::span<const ReadSegment> segments);
+        FsError writev(unsigned int osFd, std::span<const WriteSegment> segments);
+        FsError stat(unsigned int osFd, FileStat& stat);
+        // Free space as kept in the header: no scan of the map or the table
+        FsError statfs(FsStat& stat);
+        FsError create(std::string_view path);
+        FsError link(std::string_view target, std::string_view name);
+        FsError unlink(std::string_view path);
+        FsError mkdir(std::string_view path);
+        FsError rmdir(std::string_view path);
+        // The link is created in the working directory
+        FsError symlink(std::string_view target, std::string_view linkName);
+        // Flushes everything written so far onto the image
+        FsError sync();
+        // Lists a directory ("" is the working one) in batches: readdir
+        // returns up to maxEntries entries and an empty batch at the end.
+        // Names of a batch are read at once, in block order; types come
+        // from the entries themselves
+        FsError opendir(std::string_view path, DirCursor& cursor);
+        FsError readdir(DirCursor& cursor, unsigned int maxEntries, std::vector<DirEntry>& batch);
+
+        // Asynchronous counterparts, run on the same pool of workers. Reads of open
+        // files overlap each other; requests that change something wait for
+        // the rest. They are not traced, and ChecksumError surfaces from the
+        // future's get()
+        std::future<FsResult<unsigned int>> asyncOpen(std::string path);
+        std::future<FsError> asyncClose(unsigned int osFd);
+        std::future<FsResult<std::string>> asyncRead(unsigned int osFd,
+                unsigned int shift, unsigned int size);
+        std::future<FsError> asyncWrite(unsigned int osFd, unsigned int shift, std::string data);
+        std::future<FsError> asyncCreate(std::string path);
+        std::future<FsError> asyncUnlink(std::string path);
+        std::future<FsError> asyncSync();
 
         FileSystem();
 
@@ -70,31 +286,132 @@ class FileSystem {
                 const DeviceFileDescriptor& dir,
                 const std::string& name) const;
 
-        bool create(uint16_t dirIndex, DeviceFileDescriptor& dir,
-                std::string name, uint16_t fdIndex);
+        FsError create(uint16_t dirIndex, DeviceFileDescriptor& dir,
+                std::string name, uint16_t fdIndex, DeviceFileType type);
 
         std::string resolveSymlink(const DeviceFileDescriptor& fd) const;
 
         bool remove(const DeviceFileDescriptor& fd, uint16_t fdIndex);
 
+        // The map and reference counts onto the device, or on commit
+        void writeMap();
+        // The free space counters of the header, if they changed
+        void writeCounters();
+
     private:
-        bool mount(const std::string& deviceName);
+        // Options: "ram" to load the whole image into a RamDevice (dumped
+        // back on umount), "compress" to compress all newly created files,
+        // "writeback" to cache writes and flush them in the background,
+        // "snapshot=<name>" to mount a snapshot read-only
+        bool mount(const std::string& deviceName, const std::vector<std::string>& options);
+        // NotMounted or ReadOnly if a call cannot go ahead
+        FsError usable(bool modifying) const;
         bool umount();
         bool filestat(unsigned int id);
         bool ls();
-        bool create(std::string path);
-        bool open(const std::string& path, unsigned int& fd_out);
-        bool close(unsigned int fd);
-        bool read(unsigned int fd, unsigned int shift, unsigned int size, std::string& buff);
-        bool write(unsigned int fd, unsigned int shift, const std::string& buff);
-        bool link(const std::string& name1, const std::string& name2);
-        bool unlink(const std::string& name);
         bool truncate(const std::string& name, unsigned int size);
-        bool mkdir(const std::string& name);
-        bool rmdir(const std::string& name);
         bool cd(std::string path);
         bool pwd();
-        bool symlink(std::string target, const std::string& linkName);
+        bool compress(const std::string& path, bool enable);
+        // Reserves (zeroed, preferably contiguous) blocks for the first
+        // size bytes of a file, extending it if needed. Later writes fill
+        // them in place without calling the allocator
+        bool fallocate(const std::string& path, unsigned int size);
+        // Prints the next offset holding data (or within a hole)
+        bool seek(unsigned int fd, const std::string& whence, unsigned int offset);
+        // Like lseek with SEEK_DATA/SEEK_HOLE, nullopt if there is none
+        std::optional<unsigned int> seek(const DeviceFileDescriptor& dfd,
+                unsigned int offset, bool data) const;
+        // New file sharing all the data blocks of source, copied on write
+        bool clone(const std::string& source, const std::string& destination);
+
+        bool createSnapshot(const std::string& name);
+        // Marks it for deletion, its blocks are released by reclaimSnapshots
+        bool deleteSnapshot(const std::string& name);
+        bool listSnapshots();
+        bool mountSnapshot(const std::string& name);
+        // Releases the blocks of up to maxDescriptors FDs of deleted snapshots
+        void reclaimSnapshots(unsigned int maxDescriptors);
+
+        // Operate on a descriptor directly, regardless of open files
+        FsError readData(const DeviceFileDescriptor& dfd,
+                unsigned int shift, std::span<char> buff);
+        FsError writeData(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+                unsigned int shift, std::string_view buff);
+        // Plain (not inline nor compressed) files, ranges already checked
+        FsError readBlocks(const DeviceFileDescriptor& dfd, std::span<const ReadSegment> segments);
+        FsError writeBlocks(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+                std::span<const WriteSegment> segments);
+
+        // Data block => contents and content hash, waiting to be written
+        using PendingBlocks = std::map<uint16_t, std::pair<Block, uint32_t>>;
+        // Puts the new contents of a file block somewhere: into an identical
+        // block when deduplicating, into a new one (from group) if addr is
+        // free or shared, in place otherwise. Returns where it ended up; the
+        // data goes into pending, not to the device yet
+        std::optional<uint16_t> storeBlock(uint16_t addr, const Block& data,
+                PendingBlocks& pending, unsigned int group);
+        // Writes them in address order and indexes them for deduplication
+        void writePending(PendingBlocks& pending);
+        // Drops a reference to a data block (the map is not written)
+        void releaseBlock(uint16_t addr);
+
+        // Contents of the data blocks, consecutive runs are read at once
+        std::vector<uint8_t> readDataBlocks(const std::vector<uint16_t>& addresses);
+        // File names in the name blocks, read in address order
+        std::vector<std::string> readNames(const std::vector<uint16_t>& addresses);
+        void openCursor(uint16_t dirIndex, DirCursor& cursor) const;
+        // Prints the data block map
+        bool map();
+        // Prints the free space counters
+        bool statfs();
+        // Walks the tree under path (the working directory if empty) and
+        // prints the files and bytes of every subtree, counting only the
+        // files whose name matches pattern ('*' and '?' wildcards) if any.
+        // Hard links are counted once per entry, symlinks are not followed
+        bool du(const std::string& path, const std::string& pattern);
+        // Copy the tree under a host directory into an image directory, or
+        // the other way around. A host thread reads (writes) the files while
+        // the image is written (read) by the calling one; existing
+        // directories are merged, other existing entries are skipped
+        bool importTree(const std::string& hostDir, const std::string& path);
+        bool exportTree(const std::string& path, const std::string& hostDir);
+        // Descriptor of the directory at path ("" is the working one)
+        std::optional<uint16_t> findDirectory(const std::string& path) const;
+        // Make a new entry of dir, of the given type, on the free descriptor fdIndex
+        FsError makeFile(uint16_t dirIndex, DeviceFileDescriptor& dir,
+                const std::string& name, uint16_t fdIndex);
+        FsError makeDirectory(uint16_t parentIndex, DeviceFileDescriptor& parent,
+                const std::string& name, uint16_t fdIndex);
+        FsError makeSymlink(uint16_t dirIndex, DeviceFileDescriptor& dir,
+                const std::string& name, std::string_view target, uint16_t fdIndex);
+        // Of the given descriptors (the whole table) and of the map
+        Fragmentation fragmentation(const std::vector<DeviceFileDescriptor>& fds) const;
+        // Not shared with another file or a snapshot
+        bool movable(const std::vector<uint16_t>& blocks) const;
+        // Copies the blocks of a file to the free run starting at to, then
+        // points its descriptor there (in one write) and frees the old ones
+        void relocate(uint16_t fdIndex, DeviceFileDescriptor& fd, uint16_t to);
+        // Moves fragmented files into contiguous runs (in the group of their
+        // descriptor if possible), then the files down into the holes below
+        // them so that the free space of each group ends up in one piece.
+        // Shared blocks stay where they are. Prints the fragmentation before
+        // and after; directory cursors opened before must be opened again
+        bool defrag();
+        // Until commit, descriptors, the map and every other metadata block
+        // stay in memory (written once however often they change) and are
+        // then written in block order; data blocks are written at once.
+        // umount commits
+        bool begin();
+        bool commit();
+        FsError readCluster(const DeviceCluster& cluster,
+                unsigned int rawSize, std::vector<uint8_t>& raw);
+        FsError readCompressed(const DeviceFileDescriptor& dfd,
+                unsigned int shift, std::span<char> buff);
+        FsError writeCompressed(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+                unsigned int shift, std::string_view buff);
+        FsError writeInline(DeviceFileDescriptor& dfd, uint16_t fdIndex,
+                unsigned int shift, std::string_view buff);
 };
 
 
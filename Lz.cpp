@@ -0,0 +1,120 @@
+#include "Lz.h"
+#include <cstring>
+
+
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 0xFFFF;
+static const unsigned int HASH_BITS = 12;
+
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void writeLength(std::vector<uint8_t>& out, size_t length) {
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(length));
+}
+
+static void writeSequence(std::vector<uint8_t>& out, const uint8_t* literals,
+        size_t literalsCount, size_t offset, size_t matchLength) {
+    const size_t matchCode = matchLength - MIN_MATCH;
+    const uint8_t token = static_cast<uint8_t>((literalsCount < 15 ? literalsCount : 15) << 4
+            | (matchCode < 15 ? matchCode : 15));
+    out.push_back(token);
+    if (literalsCount >= 15) writeLength(out, literalsCount - 15);
+    out.insert(out.end(), literals, literals + literalsCount);
+    out.push_back(offset & 0xFF);
+    out.push_back(offset >> 8);
+    if (matchCode >= 15) writeLength(out, matchCode - 15);
+}
+
+std::vector<uint8_t> lzCompress(const uint8_t* src, size_t size) {
+    std::vector<uint8_t> out;
+    out.reserve(size + size / 255 + 16);
+    uint32_t table[1 << HASH_BITS] = {}; // position + 1, 0 => none
+
+    size_t anchor = 0; // start of pending literals
+    size_t pos = 0;
+    while (size >= MIN_MATCH && pos <= size - MIN_MATCH) {
+        const uint32_t sequence = read32(src + pos);
+        const uint32_t h = hash(sequence);
+        const size_t candidate = table[h];
+        table[h] = pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET
+                || read32(src + candidate - 1) != sequence) {
+            pos++;
+            continue;
+        }
+
+        const size_t matchStart = candidate - 1;
+        size_t length = MIN_MATCH;
+        while (pos + length < size && src[matchStart + length] == src[pos + length]) length++;
+        writeSequence(out, src + anchor, pos - anchor, pos - matchStart, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    // Trailing literals
+    const size_t literalsCount = size - anchor;
+    out.push_back(static_cast<uint8_t>((literalsCount < 15 ? literalsCount : 15) << 4));
+    if (literalsCount >= 15) writeLength(out, literalsCount - 15);
+    out.insert(out.end(), src + anchor, src + size);
+
+    return out;
+}
+
+bool lzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize) {
+    const uint8_t* const srcEnd = src + srcSize;
+    uint8_t* const dstStart = dst;
+    uint8_t* const dstEnd = dst + dstSize;
+    const auto readLength = [&src, srcEnd](size_t& length) {
+        uint8_t byte;
+        do {
+            if (src >= srcEnd) return false;
+            byte = *src++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (src < srcEnd) {
+        const uint8_t token = *src++;
+        size_t literalsCount = token >> 4;
+        if (literalsCount == 15 && !readLength(literalsCount)) return false;
+        if (literalsCount > static_cast<size_t>(srcEnd - src)
+                || literalsCount > static_cast<size_t>(dstEnd - dst)) return false;
+        std::memcpy(dst, src, literalsCount);
+        dst += literalsCount;
+        src += literalsCount;
+        if (src == srcEnd) break; // the last sequence
+
+        if (srcEnd - src < 2) return false;
+        const size_t offset = src[0] | src[1] << 8;
+        src += 2;
+        size_t length = (token & 0x0F);
+        if (length == 15 && !readLength(length)) return false;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(dst - dstStart)
+                || length > static_cast<size_t>(dstEnd - dst)) return false;
+
+        const uint8_t* match = dst - offset;
+        if (offset >= length) {
+            std::memcpy(dst, match, length);
+            dst += length;
+        } else {
+            while (length-- > 0) *dst++ = *match++; // overlapping
+        }
+    }
+
+    return dst == dstEnd;
+}
@@ -0,0 +1,23 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+// Byte-oriented LZ77 codec in the spirit of LZ4. A compressed stream is a
+// sequence of
+//     token: 4 high bits literals count, 4 low bits (match length - 4)
+//     [extra literals count bytes], literals,
+//     uint16_t LE match offset, [extra match length bytes]
+// where a count of 15 continues in the following bytes (255 => go on).
+// The last sequence has literals only.
+std::vector<uint8_t> lzCompress(const uint8_t* src, size_t size);
+
+// dstSize must be exactly the size of the original data.
+// Returns false on malformed input.
+bool lzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize);
+
+
+#endif
@@ -0,0 +1,62 @@
+#include "RamDevice.h"
+#include <cstring>
+
+
+RamDevice::RamDevice(unsigned int size) : m_Bytes(size, 0) {}
+
+void RamDevice::writeBlock(unsigned int index, const Block& block) {
+    assert((index + 1) * BLOCK_SIZE <= m_Bytes.size());
+    std::memcpy(m_Bytes.data() + index * BLOCK_SIZE, block.asArray(), BLOCK_SIZE);
+}
+
+void RamDevice::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
+    assert((shift + blocks.size()) * BLOCK_SIZE <= m_Bytes.size());
+    KERNELS->gather(blocks, m_Bytes.data() + shift * BLOCK_SIZE);
+}
+
+Block RamDevice::readBlock(unsigned int index) {
+    assert((index + 1) * BLOCK_SIZE <= m_Bytes.size());
+    return Block{m_Bytes.data() + index * BLOCK_SIZE};
+}
+
+std::vector<Block> RamDevice::readBlocks(unsigned int shift, unsigned int amount) {
+    assert((shift + amount) * BLOCK_SIZE <= m_Bytes.size());
+    return KERNELS->scatter(m_Bytes.data() + shift * BLOCK_SIZE, amount * BLOCK_SIZE);
+}
+
+void RamDevice::readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out) {
+    assert((shift + amount) * BLOCK_SIZE <= m_Bytes.size());
+    std::memcpy(out, m_Bytes.data() + shift * BLOCK_SIZE, amount * BLOCK_SIZE);
+}
+
+void RamDevice::sync() {
+    if (!m_BackingName.empty()) dump(m_BackingName);
+}
+
+bool RamDevice::dump(const std::string& name) const {
+    std::ofstream file(name, file.binary | file.out | file.trunc);
+    if (!file.is_open()) return false;
+    file.write(reinterpret_cast<const char*>(m_Bytes.data()), m_Bytes.size());
+
+    return static_cast<bool>(file);
+}
+
+std::unique_ptr<RamDevice> RamDevice::load(const std::string& name) {
+    std::ifstream file(name, file.binary | file.in | file.ate);
+    if (!file.is_open()) return nullptr;
+    const unsigned int size = file.tellg();
+    auto device = std::make_unique<RamDevice>(size);
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(device->m_Bytes.data()), size);
+    if (!file) return nullptr;
+    device->m_BackingName = name;
+
+    return device;
+}
+
+std::unique_ptr<RamDevice> RamDevice::createEmpty(const DeviceFormat& format) {
+    auto device = std::make_unique<RamDevice>(imageSize(format));
+    Device::format(*device, format);
+
+    return device;
+}
@@ -0,0 +1,46 @@
+#ifndef RAMDEVICE_H
+#define RAMDEVICE_H
+
+#include "Device.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Device kept entirely in memory. Isolates the engine from the host file
+// system and page cache; the contents can be dumped back into an image.
+struct RamDevice : public Device {
+    private:
+        std::vector<uint8_t> m_Bytes;
+        std::string m_BackingName; // image to sync() into, if any
+
+    public:
+        void writeBlock(unsigned int index, const Block& block) override;
+        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) override;
+        Block readBlock(unsigned int index) override;
+        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) override;
+        void readBlocksInto(unsigned int shift, unsigned int amount, uint8_t* out) override;
+
+        // Dumps into the image the device was loaded from (if it was)
+        void sync() override;
+
+        inline bool is_open() const override {
+            return true;
+        }
+
+        inline unsigned int getSize() const override {
+            return m_Bytes.size();
+        }
+
+        bool dump(const std::string& name) const;
+
+        // Zero-filled device of the specified size in bytes
+        explicit RamDevice(unsigned int size);
+
+        // Returns nullptr if the image could not be read
+        static std::unique_ptr<RamDevice> load(const std::string& name);
+        static std::unique_ptr<RamDevice> createEmpty(const DeviceFormat& format);
+};
+
+
+#endif
@@ -0,0 +1,96 @@
+#include "ThreadPool.h"
+
+
+ThreadPool::ThreadPool(unsigned int threads) : m_Stopping(false) {
+    for (unsigned int i = 0; i < threads; i++) {
+        m_Workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Wakeup.notify_all();
+    for (std::thread& worker : m_Workers) worker.join();
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Wakeup.wait(lock, [this]() { return m_Stopping || !m_Tasks.empty(); });
+            if (m_Tasks.empty()) return; // stopping
+            task = std::move(m_Tasks.front());
+            m_Tasks.pop();
+        }
+        task();
+    }
+}
+
+
+WorkStealingRunner::WorkStealingRunner(unsigned int threads) : m_Pending(0) {
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+        m_Queues.push_back(std::make_unique<Queue>());
+    }
+}
+
+void WorkStealingRunner::spawn(unsigned int worker, Task task) {
+    m_Pending++;
+    std::lock_guard<std::mutex> lock(m_Queues[worker]->mutex);
+    m_Queues[worker]->tasks.push_back(std::move(task));
+}
+
+std::function<void()> WorkStealingRunner::take(unsigned int worker) {
+    {
+        Queue& own = *m_Queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            Task task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return [task = std::move(task), worker]() { task(worker); };
+        }
+    }
+    for (unsigned int i = 1; i < m_Queues.size(); i++) {
+        Queue& victim = *m_Queues[(worker + i) % m_Queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            Task task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return [task = std::move(task), worker]() { task(worker); };
+        }
+    }
+    return {};
+}
+
+void WorkStealingRunner::workerLoop(unsigned int worker) {
+    while (m_Pending > 0) {
+        const std::function<void()> task = take(worker);
+        if (!task) {
+            // Others may still spawn something
+            std::this_thread::yield();
+            continue;
+        }
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_ErrorMutex);
+            if (!m_Error) m_Error = std::current_exception();
+        }
+        m_Pending--;
+    }
+}
+
+void WorkStealingRunner::run(Task root) {
+    m_Error = nullptr;
+    spawn(0, std::move(root));
+    std::vector<std::thread> threads;
+    for (unsigned int worker = 1; worker < m_Queues.size(); worker++) {
+        threads.emplace_back(&WorkStealingRunner::workerLoop, this, worker);
+    }
+    workerLoop(0);
+    for (std::thread& thread : threads) thread.join();
+    if (m_Error) std::rethrow_exception(m_Error);
+}
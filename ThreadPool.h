@@ -0,0 +1,143 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <deque>
+#include <atomic>
+#include <exception>
+#include <optional>
+
+
+// Fixed set of worker threads running submitted tasks in FIFO order.
+// Tasks still queued on destruction are run before the workers exit.
+class ThreadPool {
+    private:
+        std::vector<std::thread> m_Workers;
+        std::mutex m_Mutex; // guards the fields below
+        std::condition_variable m_Wakeup;
+        std::queue<std::function<void()>> m_Tasks;
+        bool m_Stopping;
+
+        void workerLoop();
+
+    public:
+        // The future also carries whatever the task throws
+        template<typename F>
+        auto submit(F&& task) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+            using Result = std::invoke_result_t<std::decay_t<F>>;
+            // std::function needs a copyable callable
+            auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+            std::future<Result> result = packaged->get_future();
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Tasks.emplace([packaged]() { (*packaged)(); });
+            }
+            m_Wakeup.notify_one();
+            return result;
+        }
+
+        inline unsigned int size() const {
+            return m_Workers.size();
+        }
+
+        explicit ThreadPool(unsigned int threads);
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        ~ThreadPool();
+};
+
+
+// Runs a task, and every task it spawns, to completion on a set of threads
+// started for the occasion. Each thread works on its own deque, newest task
+// first, and once it runs dry steals the oldest task of another thread:
+// fits recursive work such as tree walks, where tasks spawn more tasks
+class WorkStealingRunner {
+    public:
+        // Gets the index of the thread running it, to spawn from
+        using Task = std::function<void(unsigned int worker)>;
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> m_Queues; // per thread
+        std::atomic<unsigned int> m_Pending; // spawned and not finished
+        std::mutex m_ErrorMutex;
+        std::exception_ptr m_Error; // the first thrown by a task
+
+        std::function<void()> take(unsigned int worker);
+        void workerLoop(unsigned int worker);
+
+    public:
+        // Blocks until root and all the spawned tasks are done. Rethrows
+        // what a task has thrown (the remaining tasks still run)
+        void run(Task root);
+        // Only from within a task, with the worker it got
+        void spawn(unsigned int worker, Task task);
+
+        inline unsigned int size() const {
+            return m_Queues.size();
+        }
+
+        explicit WorkStealingRunner(unsigned int threads);
+};
+
+
+// Hands items from one thread to another in FIFO order: push waits while
+// capacity items are queued, pop while there are none. Once closed, push
+// refuses new items and pop drains the remaining ones, then gets nullopt
+template<typename T>
+class BoundedQueue {
+    private:
+        std::mutex m_Mutex; // guards the fields below
+        std::condition_variable m_NotFull;
+        std::condition_variable m_NotEmpty;
+        std::queue<T> m_Items;
+        const unsigned int m_Capacity;
+        bool m_Closed;
+
+    public:
+        // False if the queue was closed, the item is dropped
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_NotFull.wait(lock, [this]() { return m_Closed || m_Items.size() < m_Capacity; });
+            if (m_Closed) return false;
+            m_Items.push(std::move(item));
+            m_NotEmpty.notify_one();
+            return true;
+        }
+
+        std::optional<T> pop() {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_NotEmpty.wait(lock, [this]() { return m_Closed || !m_Items.empty(); });
+            if (m_Items.empty()) return std::nullopt;
+            std::optional<T> item(std::move(m_Items.front()));
+            m_Items.pop();
+            m_NotFull.notify_one();
+            return item;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Closed = true;
+            m_NotFull.notify_all();
+            m_NotEmpty.notify_all();
+        }
+
+        explicit BoundedQueue(unsigned int capacity)
+                : m_Capacity(capacity),
+                m_Closed(false) {}
+};
+
+
+#endif
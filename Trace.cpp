@@ -0,0 +1,88 @@
+#include "Trace.h"
+#include <algorithm>
+
+
+static const char TRACE_MAGIC[4] = {'F', 'S', 'T', 'R'};
+static const uint8_t TRACE_VERSION = 1;
+
+
+TraceWriter::TraceWriter(const std::string& name)
+        : m_File(name, m_File.binary | m_File.out | m_File.trunc),
+        m_Start(std::chrono::steady_clock::now()),
+        m_LastTimestamp(0) {
+    if (!m_File.is_open()) return;
+    m_File.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    m_File.put(TRACE_VERSION);
+}
+
+void TraceWriter::writeVarint(uint64_t value) {
+    while (value >= 0x80) {
+        m_File.put(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    m_File.put(static_cast<char>(value));
+}
+
+void TraceWriter::record(uint8_t command, const std::vector<std::string>& arguments) {
+    const uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_Start).count();
+    writeVarint(timestamp - m_LastTimestamp);
+    m_LastTimestamp = timestamp;
+
+    m_File.put(command);
+    m_File.put(static_cast<char>(arguments.size()));
+    for (const std::string& argument : arguments) {
+        writeVarint(argument.size());
+        m_File.write(argument.data(), argument.size());
+    }
+}
+
+
+TraceReader::TraceReader(const std::string& name)
+        : m_File(name, m_File.binary | m_File.in),
+        m_LastTimestamp(0),
+        m_Valid(false) {
+    if (!m_File.is_open()) return;
+    char magic[sizeof(TRACE_MAGIC)];
+    m_File.read(magic, sizeof(magic));
+    const int version = m_File.get();
+    m_Valid = m_File && std::equal(magic, magic + sizeof(magic), TRACE_MAGIC)
+        && version == TRACE_VERSION;
+}
+
+std::optional<uint64_t> TraceReader::readVarint() {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        const int byte = m_File.get();
+        if (byte == std::char_traits<char>::eof()) return std::nullopt;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return {value};
+    }
+    return std::nullopt; // malformed
+}
+
+// Returns nullopt at the end of the trace (or on a truncated record)
+std::optional<TraceRecord> TraceReader::next() {
+    if (!m_Valid) return std::nullopt;
+
+    const auto deltaOpt = readVarint();
+    if (!deltaOpt) return std::nullopt;
+    const int command = m_File.get();
+    const int argumentsCount = m_File.get();
+    if (argumentsCount == std::char_traits<char>::eof()) return std::nullopt;
+
+    TraceRecord record;
+    m_LastTimestamp += *deltaOpt;
+    record.timestamp = m_LastTimestamp;
+    record.command = static_cast<uint8_t>(command);
+    for (int i = 0; i < argumentsCount; i++) {
+        const auto lengthOpt = readVarint();
+        if (!lengthOpt) return std::nullopt;
+        std::string argument(*lengthOpt, '\0');
+        m_File.read(argument.data(), argument.size());
+        if (!m_File) return std::nullopt;
+        record.arguments.push_back(std::move(argument));
+    }
+
+    return {record};
+}
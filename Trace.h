@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+
+// Binary trace of processed commands.
+// Layout: "FSTR", version byte, then a sequence of records:
+//     varint  nanoseconds since the previous record
+//     uint8   command
+//     uint8   amount of arguments
+//     per argument: varint length, raw bytes
+// The command is stored as its Command value, so new commands must only
+// ever be appended to the enum.
+struct TraceRecord {
+    uint64_t timestamp; // nanoseconds since the start of the trace
+    uint8_t command;
+    std::vector<std::string> arguments;
+};
+
+
+class TraceWriter {
+    private:
+        std::ofstream m_File;
+        std::chrono::steady_clock::time_point m_Start;
+        uint64_t m_LastTimestamp;
+
+        void writeVarint(uint64_t value);
+
+    public:
+        void record(uint8_t command, const std::vector<std::string>& arguments);
+
+        inline bool is_open() const {
+            return m_File.is_open();
+        }
+
+        TraceWriter(const std::string& name);
+};
+
+
+class TraceReader {
+    private:
+        std::ifstream m_File;
+        uint64_t m_LastTimestamp;
+        bool m_Valid;
+
+        std::optional<uint64_t> readVarint();
+
+    public:
+        std::optional<TraceRecord> next();
+
+        inline bool is_open() const {
+            return m_Valid;
+        }
+
+        TraceReader(const std::string& name);
+};
+
+
+#endif
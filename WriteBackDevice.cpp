@@ -0,0 +1,122 @@
+#include "WriteBackDevice.h"
+
+
+WriteBackDevice::WriteBackDevice(std::unique_ptr<Device> device,
+        clock::duration maxAge, unsigned int maxDirtyBytes)
+        : m_Device(std::move(device)),
+        m_MaxAge(maxAge),
+        m_MaxDirtyBytes(maxDirtyBytes),
+        m_Stopping(false),
+        m_Flusher(&WriteBackDevice::flusherLoop, this) {}
+
+WriteBackDevice::~WriteBackDevice() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Wakeup.notify_all();
+    m_Flusher.join();
+    flush(true);
+}
+
+bool WriteBackDevice::overLimit() const {
+    return m_Dirty.size() * BLOCK_SIZE > m_MaxDirtyBytes;
+}
+
+void WriteBackDevice::flusherLoop() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (!m_Stopping) {
+        m_Wakeup.wait_for(lock, m_MaxAge / 4, [this]() { return m_Stopping || overLimit(); });
+        if (m_Stopping) break;
+        lock.unlock();
+        flush(false);
+        lock.lock();
+    }
+}
+
+void WriteBackDevice::flush(bool all) {
+    std::lock_guard<std::mutex> deviceLock(m_DeviceMutex);
+    std::vector<std::pair<unsigned int, Block>> batch;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        all = all || overLimit();
+        const clock::time_point oldEnough = clock::now() - m_MaxAge;
+        for (auto it = m_Dirty.begin(); it != m_Dirty.end();) {
+            if (all || it->second.since <= oldEnough) {
+                batch.emplace_back(it->first, std::move(it->second.block));
+                it = m_Dirty.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    // In index order, runs of consecutive blocks at once
+    for (unsigned int i = 0; i < batch.size();) {
+        std::vector<Block> run = {std::move(batch[i].second)};
+        while (i + run.size() < batch.size() && batch[i + run.size()].first == batch[i].first + run.size()) {
+            run.push_back(std::move(batch[i + run.size()].second));
+        }
+        m_Device->writeBlocks(batch[i].first, run);
+        i += run.size();
+    }
+}
+
+unsigned int WriteBackDevice::dirtyBlocks() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Dirty.size();
+}
+
+void WriteBackDevice::writeBlock(unsigned int index, const Block& block) {
+    writeBlocks(index, {block});
+}
+
+void WriteBackDevice::writeBlocks(unsigned int shift, const std::vector<Block>& blocks) {
+    bool throttle;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        const clock::time_point now = clock::now();
+        for (unsigned int i = 0; i < blocks.size(); i++) {
+            const auto [it, inserted] = m_Dirty.try_emplace(shift + i, DirtyBlock{blocks[i], now});
+            if (!inserted) it->second.block = blocks[i]; // keeps its age
+        }
+        // Writers wait for the device only if the flusher cannot keep up
+        throttle = m_Dirty.size() * BLOCK_SIZE > 2 * m_MaxDirtyBytes;
+        if (overLimit()) m_Wakeup.notify_one();
+    }
+    if (throttle) flush(true);
+}
+
+Block WriteBackDevice::readBlock(unsigned int index) {
+    return readBlocks(index, 1)[0];
+}
+
+std::vector<Block> WriteBackDevice::readBlocks(unsigned int shift, unsigned int amount) {
+    {
+        // Served from the cache alone, without waiting for a flush
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        const auto from = m_Dirty.lower_bound(shift);
+        if (std::distance(from, m_Dirty.lower_bound(shift + amount)) == static_cast<long>(amount)) {
+            std::vector<Block> blocks;
+            for (auto it = from; blocks.size() < amount; it++) blocks.push_back(it->second.block);
+            return blocks;
+        }
+    }
+
+    // Holding the device keeps the flusher from moving blocks out of
+    // the cache while they are not on the device yet
+    std::lock_guard<std::mutex> deviceLock(m_DeviceMutex);
+    std::vector<Block> blocks = m_Device->readBlocks(shift, amount);
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (auto it = m_Dirty.lower_bound(shift); it != m_Dirty.end() && it->first < shift + amount; it++) {
+        blocks[it->first - shift] = it->second.block;
+    }
+
+    return blocks;
+}
+
+void WriteBackDevice::sync() {
+    flush(true);
+    std::lock_guard<std::mutex> deviceLock(m_DeviceMutex);
+    m_Device->sync();
+}
@@ -0,0 +1,74 @@
+#ifndef WRITEBACKDEVICE_H
+#define WRITEBACKDEVICE_H
+
+#include "Device.h"
+#include <memory>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+
+// Keeps written blocks in memory and returns immediately. A background
+// thread writes them to the underlying device once the oldest one is
+// older than maxAge, or as soon as more than maxDirtyBytes are pending.
+// sync() (and destruction) writes everything out.
+struct WriteBackDevice : public Device {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        inline static const clock::duration DEFAULT_MAX_AGE = std::chrono::seconds(1);
+        inline static const unsigned int DEFAULT_MAX_DIRTY_BYTES = 1024 * 1024;
+
+    private:
+        struct DirtyBlock {
+            Block block;
+            clock::time_point since; // first write since the last flush
+        };
+
+        std::unique_ptr<Device> m_Device;
+        const clock::duration m_MaxAge;
+        const unsigned int m_MaxDirtyBytes;
+
+        // Lock order: m_DeviceMutex, then m_Mutex
+        std::mutex m_DeviceMutex; // held while the underlying device is used
+        std::mutex m_Mutex; // guards the fields below
+        std::condition_variable m_Wakeup;
+        std::map<unsigned int, DirtyBlock> m_Dirty; // ordered to merge runs
+        bool m_Stopping;
+
+        std::thread m_Flusher;
+
+        void flusherLoop();
+        // Writes out the dirty blocks, all of them or only the old enough ones
+        void flush(bool all);
+        bool overLimit() const;
+
+    public:
+        void writeBlock(unsigned int index, const Block& block) override;
+        void writeBlocks(unsigned int shift, const std::vector<Block>& blocks) override;
+        Block readBlock(unsigned int index) override;
+        std::vector<Block> readBlocks(unsigned int shift, unsigned int amount) override;
+
+        void sync() override;
+
+        inline bool is_open() const override {
+            return m_Device->is_open();
+        }
+
+        inline unsigned int getSize() const override {
+            return m_Device->getSize();
+        }
+
+        // Amount of written blocks not flushed yet
+        unsigned int dirtyBlocks();
+
+        WriteBackDevice(std::unique_ptr<Device> device,
+                clock::duration maxAge = DEFAULT_MAX_AGE,
+                unsigned int maxDirtyBytes = DEFAULT_MAX_DIRTY_BYTES);
+        ~WriteBackDevice() override;
+};
+
+
+#endif
@@ -0,0 +1,405 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <cstdio>
+#include "FileSystem.h"
+
+
+// Microbenchmarks for the hot paths of the engine.
+// Every result is printed as one JSON object per line, so that the output
+// of different releases can be collected and compared by scripts.
+
+static const std::string IMAGE_NAME = "bench.img";
+
+// Geometry of the image used by the benchmarks: 512-byte blocks,
+// one-block descriptors (254 pointers), 8 MiB of data
+static DeviceFormat benchFormat() {
+    DeviceFormat format;
+    format.blockSize = 512;
+    format.maxFiles = 512;
+    format.blocksPerFile = 254;
+    format.dataCapacityBlocks = 16384;
+    return format;
+}
+
+static const std::chrono::milliseconds MIN_DURATION(200);
+
+// "ram" (default) or "file" (pass --file), reported with every result
+static std::string deviceKind = "ram";
+
+
+// The engine reports everything through std::cout, which must not end up
+// in the measurements (nor in the machine-readable output)
+struct QuietCout {
+    QuietCout() { std::cout.setstate(std::ios::badbit); }
+    ~QuietCout() { std::cout.clear(); }
+};
+
+
+struct Result {
+    std::string name;
+    unsigned long long iterations;
+    double nsPerOp;
+    unsigned long long bytesPerOp;
+};
+
+std::ostream& operator<<(std::ostream& stream, const Result& result) {
+    stream << "{\"benchmark\":\"" << result.name << "\""
+        << ",\"device\":\"" << deviceKind << "\""
+        << ",\"iterations\":" << result.iterations
+        << ",\"ns_per_op\":" << result.nsPerOp;
+    if (result.bytesPerOp > 0) {
+        const double mibPerSec = (result.bytesPerOp / (1024.0 * 1024.0))
+            / (result.nsPerOp / 1e9);
+        stream << ",\"bytes_per_op\":" << result.bytesPerOp
+            << ",\"mib_per_s\":" << mibPerSec;
+    }
+    stream << "}";
+    return stream;
+}
+
+// Runs op in growing batches until MIN_DURATION is reached
+Result run(const std::string& name, unsigned long long bytesPerOp,
+        const std::function<void()>& op) {
+    using clock = std::chrono::steady_clock;
+    unsigned long long iterations = 0;
+    unsigned long long batch = 1;
+    clock::duration elapsed{0};
+    {
+        QuietCout quiet;
+        op(); // warm-up
+        while (elapsed < MIN_DURATION) {
+            const auto start = clock::now();
+            for (unsigned long long i = 0; i < batch; i++) op();
+            elapsed += clock::now() - start;
+            iterations += batch;
+            batch *= 2;
+        }
+    }
+    const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    const Result result{name, iterations, ns / iterations, bytesPerOp};
+    std::cout << result << std::endl;
+    return result;
+}
+
+bool call(FileSystem& fs, Command command, std::vector<std::string> arguments) {
+    QuietCout quiet;
+    return fs.process(command, arguments);
+}
+
+
+void benchBlockMap() {
+    const unsigned int size = benchFormat().dataCapacityBlocks;
+    for (unsigned int taken : {0u, size / 2, size - 1}) {
+        DeviceBlockMap map(size);
+        for (unsigned int i = 0; i < taken; i++) map.setTaken(i);
+        volatile unsigned int sink = 0;
+        run("DeviceBlockMap::findFree/taken=" + std::to_string(taken), 0,
+            [&]() { sink = *map.findFree(); });
+    }
+}
+
+// Taking blocks one at a time, from a group that is already full (so
+// that the search moves on by the group counters) or from a free one
+void benchAllocate() {
+    const unsigned int size = benchFormat().dataCapacityBlocks;
+    const unsigned int groups = 4;
+    const unsigned int count = 512;
+    DeviceBlockMap map(size);
+    map.setGroups(size / groups);
+    for (unsigned int i = 0; i < size / groups; i++) map.setTaken(i);
+    for (bool full : {true, false}) {
+        run(std::string("DeviceBlockMap::allocate/blocks=512/") + (full ? "full group" : "free group"),
+            0, [&]() {
+                std::vector<unsigned int> taken;
+                for (unsigned int i = 0; i < count; i++) taken.push_back(*map.allocate(full ? 0 : 1));
+                for (unsigned int block : taken) map.setFree(block);
+            });
+    }
+}
+
+void benchDescriptor(Device& device) {
+    const DeviceFileDescriptor dfd = DeviceFileDescriptor::read(device, 0);
+    volatile unsigned int sink = 0;
+    run("DeviceFileDescriptor::read", 0, [&]() {
+        sink = DeviceFileDescriptor::read(device, 0).size;
+    });
+    run("DeviceFileDescriptor::serialize", 0, [&]() {
+        sink = dfd.serialize().size();
+    });
+    std::vector<uint8_t> record(DeviceFileDescriptor::sizeInBytes());
+    run("DeviceFileDescriptor::encode", 0, [&]() {
+        dfd.encode(record.data());
+        sink = record[0];
+    });
+    run("DeviceFileDescriptor::decode", 0, [&]() {
+        sink = DeviceFileDescriptor::decode(record.data()).size;
+    });
+}
+
+void benchExtractPath(FileSystem& fs) {
+    const unsigned int maxDepth = 8;
+    std::string path;
+    for (unsigned int depth = 1; depth <= maxDepth; depth++) {
+        path += "/d";
+        call(fs, Command::Mkdir, {path});
+    }
+
+    std::string lookup;
+    for (unsigned int depth = 1; depth <= maxDepth; depth++) {
+        lookup += "/d";
+        const std::string target = lookup + "/x";
+        volatile bool sink = false;
+        run("FileSystem::extractPath/depth=" + std::to_string(depth), 0,
+            [&]() { sink = static_cast<bool>(fs.extractPath(target).first); });
+    }
+}
+
+void benchReadWrite(FileSystem& fs) {
+    const unsigned int fileSize = 32768;
+    call(fs, Command::Create, {"rw"});
+    call(fs, Command::Open, {"rw"});
+    const std::string osFd = "0";
+    call(fs, Command::Write, {osFd, "0", std::string(fileSize, 'x')});
+
+    std::mt19937 rng(42);
+    for (unsigned int size : {64u, 512u, 4096u, 32768u}) {
+        const std::string sizeStr = std::to_string(size);
+        std::vector<std::string> readArgs = {osFd, "0", sizeStr};
+        std::vector<std::string> writeArgs = {osFd, "0", std::string(size, 'y')};
+        run("FileSystem::write/sequential/size=" + sizeStr, size,
+            [&]() { fs.process(Command::Write, writeArgs); });
+        run("FileSystem::read/sequential/size=" + sizeStr, size,
+            [&]() { fs.process(Command::Read, readArgs); });
+
+        if (size == fileSize) continue;
+        std::uniform_int_distribution<unsigned int> shifts(0, fileSize - size);
+        run("FileSystem::write/random/size=" + sizeStr, size, [&]() {
+            writeArgs[1] = std::to_string(shifts(rng));
+            fs.process(Command::Write, writeArgs);
+        });
+        run("FileSystem::read/random/size=" + sizeStr, size, [&]() {
+            readArgs[1] = std::to_string(shifts(rng));
+            fs.process(Command::Read, readArgs);
+        });
+    }
+
+    call(fs, Command::Close, {osFd});
+}
+
+// The same reads through the typed API, without parsing nor printing
+void benchTypedRead(FileSystem& fs) {
+    const unsigned int fileSize = 32768;
+    unsigned int osFd;
+    call(fs, Command::Create, {"typed"});
+    if (fs.open("typed", osFd) != FsError::Ok) return;
+    fs.write(osFd, 0, std::string(fileSize, 'x'));
+
+    std::mt19937 rng(42);
+    std::vector<char> buffer(fileSize);
+    for (unsigned int size : {64u, 512u, 4096u}) {
+        std::uniform_int_distribution<unsigned int> shifts(0, fileSize - size);
+        run("FileSystem::read/typed/size=" + std::to_string(size), size, [&]() {
+            fs.read(osFd, shifts(rng), std::span<char>(buffer.data(), size));
+        });
+    }
+
+    // Many small records per request, one call each or all at once
+    const unsigned int records = 32;
+    const unsigned int recordSize = 16;
+    std::uniform_int_distribution<unsigned int> shifts(0, fileSize - recordSize);
+    std::vector<ReadSegment> segments(records);
+    for (unsigned int i = 0; i < records; i++) {
+        segments[i].buffer = std::span<char>(buffer.data() + i * recordSize, recordSize);
+    }
+    const std::string suffix = "/records=" + std::to_string(records) + "/size=" + std::to_string(recordSize);
+    run("FileSystem::read/loop" + suffix, records * recordSize, [&]() {
+        for (ReadSegment& segment : segments) fs.read(osFd, shifts(rng), segment.buffer);
+    });
+    run("FileSystem::readv" + suffix, records * recordSize, [&]() {
+        for (ReadSegment& segment : segments) segment.shift = shifts(rng);
+        fs.readv(osFd, segments);
+    });
+    std::vector<WriteSegment> writes(records);
+    const std::string record(recordSize, 'w');
+    for (WriteSegment& segment : writes) segment.data = record;
+    run("FileSystem::write/loop" + suffix, records * recordSize, [&]() {
+        for (WriteSegment& segment : writes) fs.write(osFd, shifts(rng), segment.data);
+    });
+    run("FileSystem::writev" + suffix, records * recordSize, [&]() {
+        for (WriteSegment& segment : writes) segment.shift = shifts(rng);
+        fs.writev(osFd, writes);
+    });
+
+    fs.close(osFd);
+}
+
+// Independent reads of different files, in flight at the same time
+void benchAsyncRead(FileSystem& fs) {
+    const unsigned int fileSize = 32768;
+    const unsigned int files = 4;
+    std::vector<unsigned int> osFds;
+    for (unsigned int i = 0; i < files; i++) {
+        const std::string name = "async" + std::to_string(i);
+        call(fs, Command::Create, {name});
+        QuietCout quiet;
+        const FsResult<unsigned int> opened = fs.asyncOpen(name).get();
+        if (opened.error != FsError::Ok) return;
+        fs.asyncWrite(opened.value, 0, std::string(fileSize, 'a' + i)).get();
+        osFds.push_back(opened.value);
+    }
+
+    std::mt19937 rng(42);
+    for (unsigned int size : {512u, 4096u}) {
+        std::uniform_int_distribution<unsigned int> shifts(0, fileSize - size);
+        run("FileSystem::asyncRead/files=" + std::to_string(files) + "/size=" + std::to_string(size),
+            files * size, [&]() {
+                std::vector<std::future<FsResult<std::string>>> pending;
+                for (unsigned int osFd : osFds) pending.push_back(fs.asyncRead(osFd, shifts(rng), size));
+                for (auto& result : pending) result.get();
+            });
+    }
+
+    for (unsigned int osFd : osFds) call(fs, Command::Close, {std::to_string(osFd)});
+}
+
+void benchReaddir(FileSystem& fs) {
+    const unsigned int files = 100;
+    call(fs, Command::Mkdir, {"big"});
+    for (unsigned int i = 0; i < files; i++) call(fs, Command::Create, {"big/f" + std::to_string(i)});
+
+    for (unsigned int batchSize : {16u, 128u}) {
+        volatile unsigned int sink = 0;
+        run("FileSystem::readdir/entries=" + std::to_string(files) + "/batch=" + std::to_string(batchSize),
+            0, [&]() {
+                DirCursor cursor;
+                std::vector<DirEntry> batch;
+                fs.opendir("big", cursor);
+                do {
+                    fs.readdir(cursor, batchSize, batch);
+                    sink = sink + batch.size();
+                } while (!batch.empty());
+            });
+    }
+
+    std::vector<std::string> duArguments = {"big"};
+    run("FileSystem::du/entries=" + std::to_string(files), 0,
+        [&]() { fs.process(Command::Du, duArguments); });
+}
+
+// The directory of benchReaddir out to the host
+void benchExport(FileSystem& fs) {
+    const std::string hostDir = (std::filesystem::temp_directory_path() / "bench.export").string();
+    std::vector<std::string> arguments = {"big", hostDir};
+    run("FileSystem::export/entries=100", 0, [&]() { fs.process(Command::Export, arguments); });
+    std::filesystem::remove_all(hostDir);
+}
+
+// A directory and a few dozen files, created and removed again
+void benchBatch(FileSystem& fs) {
+    const unsigned int files = 32;
+    std::vector<std::vector<std::string>> names;
+    for (unsigned int i = 0; i < files; i++) names.push_back({"batch/f" + std::to_string(i)});
+    std::vector<std::string> dir = {"batch"};
+    std::vector<std::string> none;
+    const auto churn = [&]() {
+        fs.process(Command::Mkdir, dir);
+        for (std::vector<std::string>& name : names) fs.process(Command::Create, name);
+        for (std::vector<std::string>& name : names) fs.process(Command::Unlink, name);
+        fs.process(Command::Rmdir, dir);
+    };
+    run("FileSystem::mkdir+create/files=" + std::to_string(files), 0, churn);
+    run("FileSystem::mkdir+create/files=" + std::to_string(files) + "/batch", 0, [&]() {
+        fs.process(Command::Begin, none);
+        churn();
+        fs.process(Command::Commit, none);
+    });
+}
+
+void benchChurn(FileSystem& fs) {
+    std::vector<std::string> name = {"churn"};
+    run("FileSystem::create+unlink", 0, [&]() {
+        fs.process(Command::Create, name);
+        fs.process(Command::Unlink, name);
+    });
+}
+
+// Free space from the header counters, and by scanning as before them
+void benchStatfs(FileSystem& fs, Device& device) {
+    const unsigned int maxFiles = benchFormat().maxFiles;
+    const DeviceBlockMap map = DeviceBlockMap::read(device, benchFormat().dataCapacityBlocks, false);
+    volatile unsigned int sink = 0;
+    run("FileSystem::statfs", 0, [&]() {
+        FsStat stat;
+        fs.statfs(stat);
+        sink = stat.freeBlocks + stat.freeDescriptors;
+    });
+    run("FileSystem::statfs/scan", 0, [&]() {
+        unsigned int free = 0;
+        for (unsigned int i = 0; i < map.size; i++) free += map.at(i);
+        sink = free + DeviceFileDescriptor::findFree(device, maxFiles, 0).size();
+    });
+}
+
+// Usage: bench [--file] [--checksums] [--dedup] [--writeback]
+//     --file       run on an image file instead of a RamDevice
+//     --checksums  format the image with block checksums
+//     --dedup      format the image with block deduplication
+//     --writeback  cache writes and flush them in the background
+int main(int argc, char* argv[]) {
+    bool onDisk = false;
+    bool writeBack = false;
+    DeviceFormat format = benchFormat();
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--file") onDisk = true;
+        else if (option == "--checksums") format.checksums = true;
+        else if (option == "--dedup") format.dedup = true;
+        else if (option == "--writeback") writeBack = true;
+    }
+    FileSystem fs;
+    std::unique_ptr<Device> device;
+    bool mounted;
+    if (onDisk) {
+        deviceKind = "file";
+        Device::createEmpty(IMAGE_NAME, format);
+        mounted = call(fs, Command::Mount, writeBack
+                ? std::vector<std::string>{IMAGE_NAME, "writeback"}
+                : std::vector<std::string>{IMAGE_NAME});
+        device = std::make_unique<FileDevice>(IMAGE_NAME);
+    } else {
+        QuietCout quiet;
+        std::unique_ptr<Device> ram = RamDevice::createEmpty(format);
+        if (writeBack) ram = std::make_unique<WriteBackDevice>(std::move(ram));
+        mounted = fs.mount(std::move(ram), "ram");
+        device = RamDevice::createEmpty(format);
+    }
+    if (format.checksums) deviceKind += "+checksums";
+    if (format.dedup) deviceKind += "+dedup";
+    if (writeBack) deviceKind += "+writeback";
+    if (!mounted) {
+        std::cerr << "Could not mount the benchmark device" << std::endl;
+        return 1;
+    }
+
+    benchBlockMap();
+    benchAllocate();
+    benchDescriptor(*device);
+    benchExtractPath(fs);
+    benchReadWrite(fs);
+    benchTypedRead(fs);
+    benchAsyncRead(fs);
+    benchReaddir(fs);
+    benchExport(fs);
+    benchBatch(fs);
+    benchChurn(fs);
+    benchStatfs(fs, *device);
+
+    call(fs, Command::Umount, {});
+    if (onDisk) std::remove(IMAGE_NAME.c_str());
+
+    return 0;
+}
@@ -41,7 +41,12 @@ int main() {
         }
 
         arguments.erase(arguments.begin());
-        lastFailed = !fs.process(command, arguments);
+        try {
+            lastFailed = !fs.process(command, arguments);
+        } catch (const std::runtime_error& e) {
+            std::cout << "## " << e.what() << std::endl;
+            lastFailed = true;
+        }
     } while (true);
 
     return 0;
@@ -0,0 +1,303 @@
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "Device.h"
+#include "RamDevice.h"
+#include "ChecksumDevice.h"
+
+
+// Offline consistency checker.
+// The image is loaded into memory and the descriptor table is scanned by
+// several threads at once. Each thread counts the references to data
+// blocks and the directory entries pointing to descriptors within its
+// slice of the table; the results are then merged and compared with the
+// stored block map and link counts.
+//
+// Usage: fsck <image> [--repair] [--threads N]
+// Exit code: 0 if consistent (or repaired), 1 if problems remain, 2 on errors
+
+
+struct DirEntryRef {
+    uint16_t dirIndex;
+    unsigned int slot; // index of the name pointer inside the dir FD
+    uint16_t fdIndex;
+};
+
+// What a single thread has found in its slice of the descriptor table
+struct ScanResult {
+    std::vector<unsigned int> blockRefs; // per data block
+    std::vector<unsigned int> links; // per descriptor
+    std::vector<DirEntryRef> entries;
+    std::vector<std::string> problems;
+};
+
+static void scan(Device& device, unsigned int from, unsigned int to,
+        unsigned int dataBlocks, unsigned int maxFiles, ScanResult& result) {
+    result.blockRefs.assign(dataBlocks, 0);
+    result.links.assign(maxFiles, 0);
+    const auto reference = [&](unsigned int fdIndex, uint16_t addr) {
+        if (addr >= dataBlocks) {
+            result.problems.push_back("FD " + std::to_string(fdIndex)
+                    + " points beyond the data blocks: " + std::to_string(addr));
+            return false;
+        }
+        result.blockRefs[addr]++;
+        return true;
+    };
+
+    for (unsigned int fdIndex = from; fdIndex < to; fdIndex++) {
+        const DeviceFileDescriptor fd = DeviceFileDescriptor::read(device, fdIndex);
+        if (fd.fileType == DeviceFileType::Empty) continue;
+
+        if (fd.fileType != DeviceFileType::Directory) {
+            unsigned int allocated = 0;
+            for (uint16_t addr : fd.dataBlocks()) {
+                if (reference(fdIndex, addr)) allocated++;
+            }
+            // Regular files may have holes and compressed clusters may take
+            // fewer blocks than the size, inline data takes none
+            if (fd.isInline() && fd.size > DeviceFileDescriptor::inlineCapacity()) {
+                result.problems.push_back("FD " + std::to_string(fdIndex) + " has size "
+                        + std::to_string(fd.size) + " but inline data holds at most "
+                        + std::to_string(DeviceFileDescriptor::inlineCapacity()) + " bytes");
+            } else if (fd.fileType == DeviceFileType::Symlink && allocated * Device::BLOCK_SIZE < fd.size) {
+                result.problems.push_back("FD " + std::to_string(fdIndex) + " has size "
+                        + std::to_string(fd.size) + " but only "
+                        + std::to_string(allocated) + " blocks");
+            } else if (!fd.isCompressed() && !fd.isInline()) {
+                for (unsigned int i = ceil(fd.size, Device::BLOCK_SIZE); i < fd.blocks.size(); i++) {
+                    if (fd.blocks[i] == DeviceFileDescriptor::FREE_BLOCK) continue;
+                    result.problems.push_back("FD " + std::to_string(fdIndex)
+                            + " has a block past its end: " + std::to_string(fd.blocks[i]));
+                }
+            }
+            continue;
+        }
+
+        for (unsigned int i = 0; i + 1 < fd.blocks.size(); i += 2) {
+            const uint16_t nameAddr = fd.blocks[i];
+            const uint16_t childIndex = DeviceFileDescriptor::entryFd(fd.blocks[i + 1]);
+            const DeviceFileType childType = DeviceFileDescriptor::entryType(fd.blocks[i + 1]);
+            if (nameAddr == DeviceFileDescriptor::FREE_BLOCK) continue;
+            if (!reference(fdIndex, nameAddr)) continue;
+            if (childIndex >= maxFiles) {
+                result.problems.push_back("Dir FD " + std::to_string(fdIndex)
+                        + " has an entry for a non-existent FD " + std::to_string(childIndex));
+                continue;
+            }
+            if (childType != DeviceFileType::Empty
+                    && childType != DeviceFileDescriptor::read(device, childIndex).fileType) {
+                result.problems.push_back("Dir FD " + std::to_string(fdIndex)
+                        + " has an entry of the wrong type for FD " + std::to_string(childIndex));
+            }
+            result.entries.push_back({static_cast<uint16_t>(fdIndex), i, childIndex});
+
+            // ".." does not count as a link, except for the root pointing to itself
+            const std::string name =
+                device.readBlock(Device::DATA_START + nameAddr).asString();
+            if (name == ".." && !(fdIndex == 0 && childIndex == 0)) continue;
+            result.links[childIndex]++;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <image> [--repair] [--threads N]" << std::endl;
+        return 2;
+    }
+    const std::string imageName = argv[1];
+    bool repair = false;
+    unsigned int threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--repair") repair = true;
+        else if (option == "--threads" && i + 1 < argc) threadsCount = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 2;
+        }
+    }
+
+    std::unique_ptr<RamDevice> device = RamDevice::load(imageName);
+    if (!device || device->getSize() < DeviceHeader::sizeInBytes()) {
+        std::cerr << "Could not read image " << imageName << std::endl;
+        return 2;
+    }
+    const DeviceHeader header = DeviceHeader::read(*device);
+    const std::string formatProblem = header.formatProblem();
+    if (!formatProblem.empty()) {
+        std::cerr << formatProblem << std::endl;
+        return 2;
+    }
+    const DeviceLayout layout = DeviceLayout::apply(header, device->getSize());
+    const unsigned int dataBlocks = layout.blocksForData;
+    const unsigned int maxFiles = header.maxFiles;
+    DeviceBlockMap map = DeviceBlockMap::read(*device, dataBlocks, layout.blocksForRefCounts > 0);
+    const bool checksums = layout.blocksForChecksums > 0;
+    const std::vector<unsigned int> corrupted = checksums
+        ? ChecksumDevice::findCorrupted(*device, layout.blocksTotal)
+        : std::vector<unsigned int>{};
+
+    // Scan the descriptor table in parallel
+    threadsCount = std::min(threadsCount, maxFiles);
+    std::vector<ScanResult> results(threadsCount);
+    std::vector<std::thread> threads;
+    const unsigned int perThread = ceil(maxFiles, threadsCount);
+    for (unsigned int t = 0; t < threadsCount; t++) {
+        const unsigned int from = std::min(maxFiles, t * perThread);
+        const unsigned int to = std::min(maxFiles, from + perThread);
+        threads.emplace_back(scan, std::ref(*device), from, to,
+                dataBlocks, maxFiles, std::ref(results[t]));
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    // Merge
+    std::vector<unsigned int> blockRefs(dataBlocks, 0);
+    std::vector<unsigned int> links(maxFiles, 0);
+    std::vector<DirEntryRef> entries;
+    std::vector<std::string> problems;
+    for (const ScanResult& result : results) {
+        for (unsigned int i = 0; i < dataBlocks; i++) blockRefs[i] += result.blockRefs[i];
+        for (unsigned int i = 0; i < maxFiles; i++) links[i] += result.links[i];
+        entries.insert(entries.end(), result.entries.begin(), result.entries.end());
+        problems.insert(problems.end(), result.problems.begin(), result.problems.end());
+    }
+
+    // Snapshots hold references as well (deleted ones only on what is not released yet)
+    for (unsigned int slot = 0; slot < header.snapshotSlots; slot++) {
+        const DeviceSnapshot snapshot = DeviceSnapshot::read(*device, slot, maxFiles);
+        if (snapshot.state == DeviceSnapshot::State::Empty) continue;
+        const unsigned int tableStart = DeviceSnapshot::tableStart(slot, maxFiles);
+        const unsigned int from =
+            (snapshot.state == DeviceSnapshot::State::Deleting) ? snapshot.reclaimed : 0;
+        for (unsigned int i = from; i < maxFiles; i++) {
+            for (uint16_t addr : DeviceFileDescriptor::read(*device, i, tableStart).dataBlocks()) {
+                if (addr < dataBlocks) blockRefs[addr]++;
+                else problems.push_back("FD " + std::to_string(i) + " of snapshot " + snapshot.name
+                        + " points beyond the data blocks: " + std::to_string(addr));
+            }
+        }
+    }
+
+    std::vector<DeviceFileDescriptor> fds;
+    fds.reserve(maxFiles);
+    for (unsigned int i = 0; i < maxFiles; i++) fds.push_back(DeviceFileDescriptor::read(*device, i));
+    std::vector<bool> fdChanged(maxFiles, false);
+    unsigned int repaired = 0;
+
+    // Entries that point to empty descriptors
+    for (const DirEntryRef& entry : entries) {
+        if (fds[entry.fdIndex].fileType != DeviceFileType::Empty) continue;
+        problems.push_back("Dir FD " + std::to_string(entry.dirIndex)
+                + " has an entry for the empty FD " + std::to_string(entry.fdIndex));
+        if (!repair) continue;
+        DeviceFileDescriptor& dir = fds[entry.dirIndex];
+        blockRefs[dir.blocks[entry.slot]]--;
+        dir.blocks[entry.slot] = DeviceFileDescriptor::FREE_BLOCK;
+        dir.blocks[entry.slot + 1] = DeviceFileDescriptor::FREE_BLOCK;
+        dir.size--;
+        fdChanged[entry.dirIndex] = true;
+        repaired++;
+    }
+
+    // Link counts and orphans
+    for (unsigned int i = 0; i < maxFiles; i++) {
+        DeviceFileDescriptor& fd = fds[i];
+        if (fd.fileType == DeviceFileType::Empty) continue;
+        if (links[i] == 0) {
+            std::stringstream problem;
+            problem << "FD " << i << " (" << fd.fileType << ") is not referenced by any directory";
+            problems.push_back(problem.str());
+            if (!repair) continue;
+            for (uint16_t addr : fd.dataBlocks()) {
+                if (addr < dataBlocks) blockRefs[addr]--;
+            }
+            fd = {};
+            fdChanged[i] = true;
+            repaired++;
+        } else if (fd.linksCount != links[i]) {
+            problems.push_back("FD " + std::to_string(i) + " has links count "
+                    + std::to_string(fd.linksCount) + " but " + std::to_string(links[i])
+                    + " directory entries");
+            if (!repair) continue;
+            fd.linksCount = links[i];
+            fdChanged[i] = true;
+            repaired++;
+        }
+    }
+
+    // Block map
+    bool mapChanged = false;
+    for (unsigned int i = 0; i < dataBlocks; i++) {
+        if (map.hasRefCounts() && blockRefs[i] > 0 && map.refCount(i) != blockRefs[i]) {
+            problems.push_back("Data block " + std::to_string(i) + " has reference count "
+                    + std::to_string(map.refCount(i)) + " but is referenced "
+                    + std::to_string(blockRefs[i]) + " times");
+            if (repair && blockRefs[i] <= UINT8_MAX) {
+                map.setRefCount(i, blockRefs[i]);
+                mapChanged = true;
+                repaired++;
+            }
+        } else if (!map.hasRefCounts() && blockRefs[i] > 1) {
+            problems.push_back("Data block " + std::to_string(i) + " is referenced "
+                    + std::to_string(blockRefs[i]) + " times");
+        }
+        const bool expectedFree = blockRefs[i] == 0;
+        if (map.at(i) == expectedFree) continue;
+        problems.push_back("Data block " + std::to_string(i) + " is marked "
+                + (expectedFree ? "taken but is not used" : "free but is used"));
+        if (!repair) continue;
+        if (expectedFree) map.setFree(i);
+        else map.setTaken(i);
+        mapChanged = true;
+        repaired++;
+    }
+
+    // Free space counters of the header, against the map and the table as repaired
+    DeviceHeader counted = header;
+    counted.freeBlocks = map.freeBlocks();
+    counted.freeDescriptors = std::count_if(fds.begin(), fds.end(),
+            [](const DeviceFileDescriptor& fd) { return fd.fileType == DeviceFileType::Empty; });
+    bool headerChanged = false;
+    if (header.freeBlocks != counted.freeBlocks || header.freeDescriptors != counted.freeDescriptors) {
+        problems.push_back("Header counts " + std::to_string(header.freeBlocks) + " free data blocks and "
+                + std::to_string(header.freeDescriptors) + " free FDs but there are "
+                + std::to_string(counted.freeBlocks) + " and " + std::to_string(counted.freeDescriptors));
+        if (repair) {
+            headerChanged = true;
+            repaired++;
+        }
+    }
+
+    // Checksums can only be brought in line with the (possibly corrupted) data
+    for (unsigned int index : corrupted) {
+        problems.push_back("Block " + std::to_string(index) + " does not match its checksum");
+        if (repair) repaired++;
+    }
+
+    for (const std::string& problem : problems) std::cout << problem << std::endl;
+    std::cout << "Checked " << maxFiles << " file descriptors and " << dataBlocks
+        << " data blocks with " << threadsCount << " threads: "
+        << problems.size() << " problem(s) found" << std::endl;
+
+    if (repaired > 0) {
+        for (unsigned int i = 0; i < maxFiles; i++) {
+            if (fdChanged[i]) DeviceFileDescriptor::write(*device, i, fds[i]);
+        }
+        if (mapChanged) map.write(*device);
+        if (headerChanged) counted.write(*device);
+        if (checksums) ChecksumDevice::initialize(*device, layout.blocksTotal);
+        if (!device->dump(imageName)) {
+            std::cerr << "Could not write the repaired image" << std::endl;
+            return 2;
+        }
+        std::cout << "Repaired " << repaired << " problem(s)" << std::endl;
+    }
+
+    return (problems.size() == repaired) ? 0 : 1;
+}
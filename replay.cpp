@@ -0,0 +1,103 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "FileSystem.h"
+#include "Trace.h"
+
+
+// Re-runs a trace recorded with `trace start <file>` against an image.
+// Every recorded mount is redirected to the given image. Per-command
+// latencies are printed as one JSON object per line.
+//
+// Usage: replay <trace> <image> [--paced] [--fresh]
+//     --paced  keep the recorded gaps between commands
+//     --fresh  format the image with the default geometry first
+
+struct QuietCout {
+    QuietCout() { std::cout.setstate(std::ios::badbit); }
+    ~QuietCout() { std::cout.clear(); }
+};
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <trace> <image> [--paced] [--fresh]" << std::endl;
+        return 1;
+    }
+    const std::string traceName = argv[1];
+    const std::string imageName = argv[2];
+    bool paced = false;
+    bool fresh = false;
+    for (int i = 3; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--paced") paced = true;
+        else if (option == "--fresh") fresh = true;
+        else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+
+    TraceReader trace(traceName);
+    if (!trace.is_open()) {
+        std::cerr << "Could not open trace " << traceName << std::endl;
+        return 1;
+    }
+    if (fresh) Device::createEmpty(imageName);
+
+    using clock = std::chrono::steady_clock;
+    std::map<Command, std::vector<double>> latencies; // in nanoseconds
+    unsigned int failed = 0;
+    FileSystem fs;
+    const auto start = clock::now();
+    while (const auto recordOpt = trace.next()) {
+        if (recordOpt->command >= static_cast<uint8_t>(Command::INVALID)) {
+            std::cerr << "Unknown command in trace, stopping" << std::endl;
+            break;
+        }
+        const Command command = static_cast<Command>(recordOpt->command);
+        std::vector<std::string> arguments = recordOpt->arguments;
+        // Whatever the mount options, never the recorded image
+        if (command == Command::Mount && !arguments.empty()) arguments[0] = imageName;
+        if (paced) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(recordOpt->timestamp));
+        }
+
+        const auto commandStart = clock::now();
+        bool result;
+        {
+            QuietCout quiet;
+            result = fs.process(command, arguments);
+        }
+        const auto elapsed = clock::now() - commandStart;
+        latencies[command].push_back(
+                std::chrono::duration<double, std::nano>(elapsed).count());
+        if (!result) failed++;
+    }
+    const double totalNs = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    unsigned int total = 0;
+    for (auto& [command, samples] : latencies) {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double sample : samples) sum += sample;
+        const auto percentile = [&samples](double p) {
+            return samples[static_cast<unsigned int>(p * (samples.size() - 1))];
+        };
+        std::cout << "{\"command\":\"" << toString(command) << "\""
+            << ",\"count\":" << samples.size()
+            << ",\"mean_ns\":" << sum / samples.size()
+            << ",\"p50_ns\":" << percentile(0.5)
+            << ",\"p99_ns\":" << percentile(0.99)
+            << ",\"max_ns\":" << samples.back() << "}" << std::endl;
+        total += samples.size();
+    }
+    std::cout << "{\"commands\":" << total << ",\"failed\":" << failed
+        << ",\"total_ns\":" << totalNs << "}" << std::endl;
+
+    return 0;
+}
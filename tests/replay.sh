@@ -0,0 +1,31 @@
+#!/bin/sh
+# A trace recorded with mount options, replayed onto another image: the
+# recorded image must be left alone and the other one get the changes
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+fs() {
+    "$root/fs"
+}
+
+for option in ram writeback compress; do
+    printf 'mkfs recorded.img\ntrace start mount.trace\nmount recorded.img %s\ncreate x\numount\ntrace stop\nq\n' \
+        "$option" | fs > /dev/null
+    printf 'mkfs recorded.img\nmkfs target.img\nq\n' | fs > /dev/null
+    cp recorded.img pristine.img
+
+    "$root/replay" mount.trace target.img > /dev/null
+
+    if ! cmp -s recorded.img pristine.img; then
+        echo "FAIL mount $option: replay changed the recorded image"
+        exit 1
+    fi
+    if ! printf 'mount target.img\nls\nq\n' | fs | grep -q -- '-- x :'; then
+        echo "FAIL mount $option: replay did not create x on the given image"
+        exit 1
+    fi
+    echo "ok mount $option"
+done